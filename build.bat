@@ -4,7 +4,8 @@ echo === Kompilerar vip ===
 gcc ^
  -o vip ^
  video2pdf.c ^
- lib/pdfgen.c
+ lib/pdfgen.c ^
+ -lpthread
 
 if %errorlevel% neq 0 (
     echo.
@@ -110,11 +110,28 @@ typedef SSIZE_T ssize_t;
 #include <sys/types.h> /* for ssize_t */
 #endif
 
+#if !defined(_MSC_VER)
+#define PDF_THREADS 1 /* Parallel stream compression, see pdf_pack_objects */
+#include <pthread.h>
+#endif
+
+#if defined(__linux__)
+#define PDF_SENDFILE 1 /* Kernel copies of image files, see writer_copy_file */
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PDF_X86_SIMD 1 /* SSSE3/AVX2 pixel conversion, see bmp_row_converter */
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define PDF_NEON 1 /* NEON pixel conversion, see bmp_row_converter */
+#include <arm_neon.h>
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <locale.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -222,6 +239,8 @@ enum {
     OBJ_pages,
     OBJ_image,
     OBJ_link,
+    OBJ_font_dict, /* /Font resources shared by all pages */
+    OBJ_gstate_dict, /* /ExtGState resources shared by all pages */
 
     OBJ_count,
 };
@@ -232,6 +251,20 @@ struct flexarray {
     int bin_count;
 };
 
+/**
+ * Objects and their small strings are carved out of large chunks, which
+ * are all released together with the document
+ */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+};
+
+struct arena {
+    struct arena_chunk *chunks; /* The first one is being filled */
+};
+
 /**
  * Simple dynamic string object. Tries to store a reasonable amount on the
  * stack before falling back to malloc once things get large
@@ -243,32 +276,69 @@ struct dstr {
     size_t used_len;
 };
 
+/**
+ * Output of a save. Small writes are gathered in a large buffer that goes
+ * to the backend in one call, bigger payloads are passed straight through.
+ * Without a backend everything stays in the (growing) buffer
+ */
+struct pdf_writer {
+    pdf_write_func write;
+    void *opaque;
+    FILE *fp; /* Output of the FILE backend, for writer_copy_file */
+    char *buffer;
+    size_t used;
+    size_t size;
+    size_t offset; /* Bytes written so far, for the xref */
+    int error;     /* First failure, output is dropped after it */
+};
+
 struct pdf_object {
     int type;                /* See OBJ_xxxx */
     int index;               /* PDF output index */
     int offset;              /* Byte position within the output file */
+    bool written;            /* Already streamed out, or for pages in */
+                             /* object stream mode sealed, see */
+                             /* pdf_flush_pages */
     struct pdf_object *prev; /* Previous of this type */
     struct pdf_object *next; /* Next of this type */
     union {
         struct {
             struct pdf_object *page;
-            char name[64];
+            char *name; /* In the arena */
             struct pdf_object *parent;
             struct flexarray children;
         } bookmark;
         struct {
             struct pdf_object *page;
             struct dstr stream;
+            uint32_t width;  /* Pixel size, images only */
+            uint32_t height;
+            uint8_t *data;   /* Image payload written after the stream */
+            size_t data_len; /* header, owned by the object */
+            bool raw;        /* Uncompressed image, its header is finished */
+                             /* with /Length and /Filter when saved */
+            uint8_t *packed;   /* Flate-compressed payload, see */
+            size_t packed_len; /* pdf_pack_objects */
+            int placements;    /* Times an image is drawn on a page */
+            int shares;        /* Extra loads of the same image data */
+            uint64_t hash;     /* Of the data an image was loaded from, */
+            size_t source_len; /* see pdf_find_image */
+            uint8_t *source;   /* Data a converted image was loaded from */
+            struct pdf_object *hash_next; /* Next image in its bucket */
+            char *path;        /* File holding the payload of data_len */
+                               /* bytes, see pdf_load_image_file */
+            struct pdf_object *smask; /* Alpha of a PNG image */
         } stream;
         struct {
             float width;
             float height;
             struct flexarray children;
             struct flexarray annotations;
+            struct flexarray images; /* XObjects drawn on this page */
         } page;
         struct pdf_info *info;
         struct {
-            char name[64];
+            char *name; /* In the arena */
             int index;
         } font;
         struct {
@@ -294,8 +364,24 @@ struct pdf_doc {
 
     struct pdf_object *current_font;
 
+    int compress_level; /* See pdf_set_compression */
+    int compress_threads;
+    bool object_streams; /* See pdf_set_object_streams */
+
+    FILE *stream_fp; /* Output of a streamed save, see pdf_save_begin */
+    char *stream_filename;
+    struct pdf_writer stream_writer;
+
     struct pdf_object *last_objects[OBJ_count];
     struct pdf_object *first_objects[OBJ_count];
+
+    struct arena arena;
+    struct pdf_object *free_objects[OBJ_count]; /* Deleted, for reuse */
+
+    /* Loaded images by the hash of their data, see pdf_find_image */
+    struct pdf_object **image_buckets;
+    size_t image_bucket_count; /* A power of two */
+    size_t image_count;
 };
 
 /**
@@ -351,11 +437,21 @@ static int bin_offset[] = {
 
 static inline int flexarray_get_bin(const struct flexarray *flex, int index)
 {
+    /* Bin n starts at 2^(n + MIN_SHIFT) - 2^MIN_SHIFT, so the bin follows
+     * from the top bit of index + 2^MIN_SHIFT */
+    unsigned int v = (unsigned int)index + (1u << MIN_SHIFT);
+
     (void)flex;
-    for (size_t i = 0; i < ARRAY_SIZE(bin_offset); i++)
-        if (index < bin_offset[i])
-            return i - 1;
-    return -1;
+    if (index < 0 || index >= bin_offset[ARRAY_SIZE(bin_offset) - 1])
+        return -1;
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(v) - MIN_SHIFT;
+#else
+    int bin = 0;
+    while (v >> (MIN_SHIFT + 1 + bin))
+        bin++;
+    return bin;
+#endif
 }
 
 static inline int flexarray_get_bin_size(const struct flexarray *flex,
@@ -431,6 +527,58 @@ static inline void *flexarray_get(const struct flexarray *flex, int index)
     return flex->bins[bin][flexarray_get_bin_offset(flex, bin, index)];
 }
 
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void *arena_alloc(struct arena *arena, size_t len)
+{
+    struct arena_chunk *chunk = arena->chunks;
+    const size_t header = ARENA_ROUND(sizeof(*chunk));
+    void *data;
+
+    len = ARENA_ROUND(len);
+    if (!chunk || chunk->size - chunk->used < len) {
+        /* Large items get a chunk of their own, behind the one in use */
+        size_t size = len > ARENA_CHUNK_SIZE / 4 ? len : ARENA_CHUNK_SIZE;
+
+        chunk = (struct arena_chunk *)malloc(header + size);
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        chunk->size = size;
+        if (size == len && arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    data = (char *)chunk + header + chunk->used;
+    chunk->used += len;
+    return data;
+}
+
+static char *arena_strdup(struct arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)arena_alloc(arena, len);
+
+    if (copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+static void arena_free(struct arena *arena)
+{
+    while (arena->chunks) {
+        struct arena_chunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
 /**
  * Simple dynamic string object. Tries to store a reasonable amount on the
  * stack before falling back to malloc once things get large
@@ -452,54 +600,523 @@ static size_t dstr_len(const struct dstr *str)
     return str->used_len;
 }
 
+/* Moves the string into a heap buffer of exactly new_len bytes */
+static ssize_t dstr_resize(struct dstr *str, size_t new_len)
+{
+    if (str->data) {
+        char *new_data = (char *)realloc((void *)str->data, new_len);
+        if (!new_data)
+            return -ENOMEM;
+        str->data = new_data;
+    } else {
+        str->data = (char *)malloc(new_len);
+        if (!str->data)
+            return -ENOMEM;
+        if (str->used_len)
+            memcpy(str->data, str->static_data, str->used_len + 1);
+    }
+
+    str->alloc_len = new_len;
+    return 0;
+}
+
 static ssize_t dstr_ensure(struct dstr *str, size_t len)
 {
     if (len <= str->alloc_len)
         return 0;
-    if (!str->data && len <= sizeof(str->static_data))
+    if (!str->data && len <= sizeof(str->static_data)) {
         str->alloc_len = len;
-    else if (str->alloc_len < len) {
-        size_t new_len;
+        return 0;
+    }
+
+    /* Growing geometrically keeps appending in pieces linear overall */
+    size_t new_len = str->alloc_len * 2;
+    if (new_len < len)
+        new_len = len;
+    return dstr_resize(str, new_len);
+}
 
-        new_len = len + 4096;
+/* Makes room for extra more bytes up front, without any slack, for data
+ * whose final size is known */
+static ssize_t dstr_reserve(struct dstr *str, size_t extra)
+{
+    size_t len = str->used_len + extra + 1;
 
-        if (str->data) {
-            char *new_data = (char *)realloc((void *)str->data, new_len);
-            if (!new_data)
-                return -ENOMEM;
-            str->data = new_data;
-        } else {
-            str->data = (char *)malloc(new_len);
-            if (!str->data)
-                return -ENOMEM;
-            if (str->used_len)
-                memcpy(str->data, str->static_data, str->used_len + 1);
+    if (len <= str->alloc_len ||
+        (!str->data && len <= sizeof(str->static_data)))
+        return dstr_ensure(str, len);
+    return dstr_resize(str, len);
+}
+
+/*
+ * printf-style formatting for everything written into the PDF.
+ * PDF numbers always use '.' as the decimal separator, whatever the
+ * locale, so this avoids the C library for them. It supports the d, i, u,
+ * x, X, o, c, s and f conversions with the usual flags, width, precision
+ * and length modifiers.
+ * %f writes the fewest decimals (at most 6, or the given precision) that
+ * read back as the same single precision value, so 1.5 is "1.5" and 2.0
+ * is "2". PDF has no exponents, so e and g are treated like f.
+ */
+
+struct format_out {
+    char *buffer;
+    size_t size;
+    size_t len; /* May run past size, like the result of snprintf */
+};
+
+static inline void format_write(struct format_out *out, const char *data,
+                                size_t len)
+{
+    if (out->len < out->size) {
+        size_t room = out->size - out->len;
+        memcpy(&out->buffer[out->len], data, len < room ? len : room);
+    }
+    out->len += len;
+}
+
+static void format_pad(struct format_out *out, char c, int count)
+{
+    char pad[16];
+
+    memset(pad, c, sizeof(pad));
+    for (; count > 0; count -= (int)sizeof(pad))
+        format_write(out, pad,
+                     count < (int)sizeof(pad) ? (size_t)count : sizeof(pad));
+}
+
+/* Writes text padded to width, on the left unless left is set */
+static void format_field(struct format_out *out, const char *text, int len,
+                         int width, bool left)
+{
+    if (!left)
+        format_pad(out, ' ', width - len);
+    format_write(out, text, len);
+    if (left)
+        format_pad(out, ' ', width - len);
+}
+
+static void format_integer(struct format_out *out, unsigned long long value,
+                           bool negative, unsigned base, bool upper,
+                           int width, int precision, bool zero_pad,
+                           bool left)
+{
+    const char *set = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char digits[64];
+    int n = sizeof(digits), zeros;
+
+    if (value || precision != 0) {
+        do {
+            digits[--n] = set[value % base];
+            value /= base;
+        } while (value);
+    }
+    zeros = precision > (int)sizeof(digits) - n
+                ? precision - ((int)sizeof(digits) - n)
+                : 0;
+    if (zero_pad && precision < 0 && !left)
+        zeros = width - ((int)sizeof(digits) - n) - negative;
+    if (zeros > n - 1)
+        zeros = n - 1;
+    while (zeros-- > 0)
+        digits[--n] = '0';
+    if (negative)
+        digits[--n] = '-';
+    format_field(out, &digits[n], (int)sizeof(digits) - n, width, left);
+}
+
+static const double format_scale[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                      1e5, 1e6, 1e7, 1e8, 1e9};
+
+static void format_real(struct format_out *out, double value, int precision,
+                        int width, bool left)
+{
+    char text[48];
+    int n = sizeof(text);
+    bool negative = value < 0;
+    bool shortest = precision < 0;
+    double magnitude = negative ? -value : value;
+    unsigned long long whole, fraction = 0;
+    int decimals = 0;
+
+    if (shortest)
+        precision = 6;
+    if (precision > 9)
+        precision = 9;
+    /* Not a number, or far beyond anything a PDF reader accepts */
+    if (magnitude != magnitude)
+        magnitude = 0;
+    if (magnitude > 1e15)
+        magnitude = 1e15;
+
+    whole = (unsigned long long)magnitude;
+    magnitude -= (double)whole;
+    for (decimals = shortest ? 0 : precision; decimals <= precision;
+         decimals++) {
+        fraction =
+            (unsigned long long)(magnitude * format_scale[decimals] + 0.5);
+        if (!shortest ||
+            (float)((double)whole + fraction / format_scale[decimals]) ==
+                (float)((double)whole + magnitude))
+            break;
+    }
+    if (decimals > precision)
+        decimals = precision;
+    if (fraction >= (unsigned long long)format_scale[decimals]) {
+        whole++;
+        fraction = 0;
+    }
+    while (decimals > 0 && fraction % 10 == 0) {
+        fraction /= 10;
+        decimals--;
+    }
+
+    for (int i = 0; i < decimals; i++) {
+        text[--n] = (char)('0' + fraction % 10);
+        fraction /= 10;
+    }
+    if (decimals)
+        text[--n] = '.';
+    do {
+        text[--n] = (char)('0' + whole % 10);
+        whole /= 10;
+    } while (whole);
+    if (negative && (n < (int)sizeof(text) - 1 || text[n] != '0'))
+        text[--n] = '-';
+    format_field(out, &text[n], (int)sizeof(text) - n, width, left);
+}
+
+static int pdf_vformat(char *buffer, size_t size, const char *fmt,
+                       va_list ap)
+{
+    struct format_out out = {buffer, size, 0};
+
+    while (*fmt) {
+        const char *start = fmt;
+        bool left = false, zero_pad = false;
+        int width = 0, precision = -1, length = 0;
+        unsigned long long value;
+        bool negative = false;
+
+        while (*fmt && *fmt != '%')
+            fmt++;
+        format_write(&out, start, fmt - start);
+        if (!*fmt)
+            break;
+        start = fmt++;
+
+        for (;; fmt++) {
+            if (*fmt == '-')
+                left = true;
+            else if (*fmt == '0')
+                zero_pad = true;
+            else if (*fmt != '+' && *fmt != ' ' && *fmt != '#')
+                break;
+        }
+        if (*fmt == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                left = true;
+                width = -width;
+            }
+            fmt++;
+        }
+        while (isdigit((unsigned char)*fmt))
+            width = width * 10 + (*fmt++ - '0');
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(ap, int);
+                fmt++;
+            }
+            while (isdigit((unsigned char)*fmt))
+                precision = precision * 10 + (*fmt++ - '0');
+        }
+        /* 'l' counts once per letter, so ll is 2 */
+        for (;; fmt++) {
+            if (*fmt == 'l')
+                length++;
+            else if (*fmt == 'z' || *fmt == 'j' || *fmt == 't')
+                length = *fmt;
+            else if (*fmt != 'h' && *fmt != 'L')
+                break;
         }
 
-        str->alloc_len = new_len;
+        switch (*fmt) {
+        case 'd':
+        case 'i': {
+            long long v;
+            if (length == 'z' || length == 't')
+                v = va_arg(ap, ptrdiff_t);
+            else if (length == 'j')
+                v = va_arg(ap, intmax_t);
+            else if (length >= 2)
+                v = va_arg(ap, long long);
+            else if (length == 1)
+                v = va_arg(ap, long);
+            else
+                v = va_arg(ap, int);
+            negative = v < 0;
+            value = negative ? 0ull - (unsigned long long)v
+                             : (unsigned long long)v;
+            format_integer(&out, value, negative, 10, false, width,
+                           precision, zero_pad, left);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (length == 'z')
+                value = va_arg(ap, size_t);
+            else if (length == 't')
+                value = (unsigned long long)va_arg(ap, ptrdiff_t);
+            else if (length == 'j')
+                value = va_arg(ap, uintmax_t);
+            else if (length >= 2)
+                value = va_arg(ap, unsigned long long);
+            else if (length == 1)
+                value = va_arg(ap, unsigned long);
+            else
+                value = va_arg(ap, unsigned int);
+            format_integer(&out, value, false,
+                           *fmt == 'u' ? 10 : *fmt == 'o' ? 8 : 16,
+                           *fmt == 'X', width, precision, zero_pad, left);
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+            format_real(&out, va_arg(ap, double), precision, width, left);
+            break;
+        case 'c': {
+            char c = (char)va_arg(ap, int);
+            format_field(&out, &c, 1, width, left);
+            break;
+        }
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            size_t len = s ? strlen(s) : 0;
+            if (precision >= 0 && (size_t)precision < len)
+                len = precision;
+            format_field(&out, s, (int)len, width, left);
+            break;
+        }
+        case '%':
+            format_write(&out, "%", 1);
+            break;
+        default:
+            /* Unknown conversion, copy it through */
+            format_write(&out, start, fmt - start + (*fmt ? 1 : 0));
+            break;
+        }
+        if (*fmt)
+            fmt++;
     }
+
+    if (size)
+        buffer[out.len < size ? out.len : size - 1] = '\0';
+    return (int)out.len;
+}
+
+#ifndef SKIP_ATTRIBUTE
+static int pdf_format(char *buffer, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+#endif
+static int pdf_format(char *buffer, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = pdf_vformat(buffer, size, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+#define WRITER_BUFFER_SIZE (256 * 1024)
+
+static void writer_init(struct pdf_writer *w, pdf_write_func write,
+                        void *opaque)
+{
+    memset(w, 0, sizeof(*w));
+    w->write = write;
+    w->opaque = opaque;
+    w->size = write ? WRITER_BUFFER_SIZE : 64 * 1024;
+    w->buffer = (char *)malloc(w->size);
+    if (!w->buffer)
+        w->error = -ENOMEM;
+}
+
+/* Hands the buffered data to the backend */
+static void writer_flush(struct pdf_writer *w)
+{
+    int e;
+
+    if (w->error || !w->write || !w->used)
+        return;
+    e = w->write(w->opaque, w->buffer, w->used);
+    w->used = 0;
+    if (e < 0)
+        w->error = e;
+}
+
+/* Makes room for len more bytes in a memory writer */
+static int writer_grow(struct pdf_writer *w, size_t len)
+{
+    size_t size = w->size;
+    char *buffer;
+
+    while (size - w->used < len)
+        size *= 2;
+    buffer = (char *)realloc(w->buffer, size);
+    if (!buffer)
+        return w->error = -ENOMEM;
+    w->buffer = buffer;
+    w->size = size;
     return 0;
 }
 
-// Locales can replace the decimal character with a ','.
-// This breaks the PDF output, so we force a 'safe' locale.
-static void force_locale(char *buf, int len)
+static void writer_write(struct pdf_writer *w, const void *data, size_t len)
+{
+    w->offset += len;
+    if (w->error)
+        return;
+
+    if (len > w->size - w->used) {
+        if (!w->write) {
+            if (writer_grow(w, len) < 0)
+                return;
+        } else {
+            writer_flush(w);
+            if (w->error)
+                return;
+            /* Not worth copying, it would fill most of the buffer */
+            if (len >= w->size / 2) {
+                int e = w->write(w->opaque, data, len);
+                if (e < 0)
+                    w->error = e;
+                return;
+            }
+        }
+    }
+    memcpy(&w->buffer[w->used], data, len);
+    w->used += len;
+}
+
+#ifndef SKIP_ATTRIBUTE
+static int writer_printf(struct pdf_writer *w, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+#endif
+static int writer_printf(struct pdf_writer *w, const char *fmt, ...)
 {
-    char *saved_locale = setlocale(LC_ALL, NULL);
+    size_t room = w->error ? 0 : w->size - w->used;
+    va_list ap, aq;
+    int len;
 
-    if (!saved_locale) {
-        *buf = '\0';
+    /* Usually formatted in place, in the free end of the buffer */
+    va_start(ap, fmt);
+    va_copy(aq, ap);
+    len = pdf_vformat(room ? &w->buffer[w->used] : NULL, room, fmt, ap);
+    if ((size_t)len < room) {
+        w->used += len;
+        w->offset += len;
+    } else if (w->error) {
+        w->offset += len;
     } else {
-        strncpy(buf, saved_locale, len - 1);
-        buf[len - 1] = '\0';
+        char *text = (char *)malloc(len + 1);
+        if (text) {
+            pdf_vformat(text, len + 1, fmt, aq);
+            writer_write(w, text, len);
+            free(text);
+        } else {
+            w->offset += len;
+            w->error = -ENOMEM;
+        }
     }
+    va_end(ap);
+    va_end(aq);
+    return len;
+}
+
+/* Flushes and releases the writer, returning the first error it hit */
+static int writer_close(struct pdf_writer *w)
+{
+    writer_flush(w);
+    free(w->buffer);
+    w->buffer = NULL;
+    return w->error;
+}
+
+static int file_write(void *opaque, const void *data, size_t len)
+{
+    errno = 0;
+    if (fwrite(data, 1, len, (FILE *)opaque) != len)
+        return errno ? -errno : -EIO;
+    return 0;
+}
 
-    setlocale(LC_NUMERIC, "POSIX");
+static void writer_init_file(struct pdf_writer *w, FILE *fp)
+{
+    writer_init(w, file_write, fp);
+    w->fp = fp;
 }
 
-static void restore_locale(char *buf)
+/*
+ * Copies the first len bytes of a file into the output. Into a FILE on
+ * Linux the kernel moves them with sendfile, anything else reads them
+ * straight into the buffer
+ */
+static int writer_copy_file(struct pdf_writer *w, const char *path,
+                            size_t len)
 {
-    setlocale(LC_ALL, buf);
+    size_t done = 0;
+    FILE *src;
+
+    w->offset += len;
+    if (w->error)
+        return w->error;
+    if ((src = fopen(path, "rb")) == NULL)
+        return w->error = -errno;
+
+#ifdef PDF_SENDFILE
+    if (w->fp) {
+        writer_flush(w);
+        if (!w->error && fflush(w->fp) == 0) {
+            while (done < len) {
+                ssize_t n =
+                    sendfile(fileno(w->fp), fileno(src), NULL, len - done);
+                if (n <= 0)
+                    break; // Not supported for these files, or too short
+                done += n;
+            }
+        }
+    }
+#endif
+
+    if (!w->write && len - done > w->size - w->used)
+        writer_grow(w, len - done);
+    while (done < len && !w->error) {
+        size_t n;
+
+        if (w->used == w->size)
+            writer_flush(w);
+        if (w->error)
+            break;
+        n = fread(&w->buffer[w->used], 1,
+                  len - done < w->size - w->used ? len - done
+                                                 : w->size - w->used,
+                  src);
+        if (n == 0)
+            w->error = ferror(src) ? -EIO : -ENODATA;
+        w->used += n;
+        done += n;
+    }
+    fclose(src);
+    return w->error;
 }
 
 #ifndef SKIP_ATTRIBUTE
@@ -509,25 +1126,29 @@ static int dstr_printf(struct dstr *str, const char *fmt, ...)
 static int dstr_printf(struct dstr *str, const char *fmt, ...)
 {
     va_list ap, aq;
+    size_t room;
     int len;
-    char saved_locale[32];
-
-    force_locale(saved_locale, sizeof(saved_locale));
 
+    /* Most output fits in the space already there, and is formatted just
+     * once */
+    room = (str->data ? str->alloc_len : sizeof(str->static_data)) -
+           str->used_len;
     va_start(ap, fmt);
     va_copy(aq, ap);
-    len = vsnprintf(NULL, 0, fmt, ap);
-    if (dstr_ensure(str, str->used_len + len + 1) < 0) {
-        va_end(ap);
-        va_end(aq);
-        restore_locale(saved_locale);
-        return -ENOMEM;
+    len = pdf_vformat(dstr_data(str) + str->used_len, room, fmt, ap);
+    if ((size_t)len < room) {
+        dstr_ensure(str, str->used_len + len + 1);
+    } else {
+        if (dstr_ensure(str, str->used_len + len + 1) < 0) {
+            va_end(ap);
+            va_end(aq);
+            return -ENOMEM;
+        }
+        pdf_vformat(dstr_data(str) + str->used_len, len + 1, fmt, aq);
     }
-    vsprintf(dstr_data(str) + str->used_len, fmt, aq);
     str->used_len += len;
     va_end(ap);
     va_end(aq);
-    restore_locale(saved_locale);
 
     return len;
 }
@@ -644,10 +1265,15 @@ static void pdf_object_destroy(struct pdf_object *object)
     case OBJ_stream:
     case OBJ_image:
         dstr_free(&object->stream.stream);
+        free(object->stream.data);
+        free(object->stream.packed);
+        free(object->stream.path);
+        free(object->stream.source);
         break;
     case OBJ_page:
         flexarray_clear(&object->page.children);
         flexarray_clear(&object->page.annotations);
+        flexarray_clear(&object->page.images);
         break;
     case OBJ_info:
         free(object->info);
@@ -656,7 +1282,33 @@ static void pdf_object_destroy(struct pdf_object *object)
         flexarray_clear(&object->bookmark.children);
         break;
     }
-    free(object);
+}
+
+/* Size of an object of the given type: it only has room for its own part
+ * of the union */
+#define OBJECT_SIZE(member)                                                  \
+    (offsetof(struct pdf_object, member) +                                   \
+     sizeof(((struct pdf_object *)NULL)->member))
+
+static size_t pdf_object_size(int type)
+{
+    switch (type) {
+    case OBJ_info:
+        return OBJECT_SIZE(info);
+    case OBJ_stream:
+    case OBJ_image:
+        return OBJECT_SIZE(stream);
+    case OBJ_font:
+        return OBJECT_SIZE(font);
+    case OBJ_page:
+        return OBJECT_SIZE(page);
+    case OBJ_bookmark:
+        return OBJECT_SIZE(bookmark);
+    case OBJ_link:
+        return OBJECT_SIZE(link);
+    default:
+        return offsetof(struct pdf_object, info);
+    }
 }
 
 static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
@@ -666,18 +1318,26 @@ static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
     if (!pdf)
         return NULL;
 
-    obj = (struct pdf_object *)calloc(1, sizeof(*obj));
+    /* Deleted objects of the same type are reused first */
+    if (pdf->free_objects[type]) {
+        obj = pdf->free_objects[type];
+        pdf->free_objects[type] = obj->next;
+    } else {
+        obj = (struct pdf_object *)arena_alloc(&pdf->arena,
+                                               pdf_object_size(type));
+    }
     if (!obj) {
-        pdf_set_err(pdf, -errno,
-                    "Unable to allocate object %d of type %d: %s",
-                    flexarray_size(&pdf->objects) + 1, type, strerror(errno));
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate object %d of type %d",
+                    flexarray_size(&pdf->objects) + 1, type);
         return NULL;
     }
 
+    memset(obj, 0, pdf_object_size(type));
     obj->type = type;
 
     if (pdf_append_object(pdf, obj) < 0) {
-        free(obj);
+        obj->next = pdf->free_objects[type];
+        pdf->free_objects[type] = obj;
         return NULL;
     }
 
@@ -688,27 +1348,20 @@ static void pdf_del_object(struct pdf_doc *pdf, struct pdf_object *obj)
 {
     int type = obj->type;
     flexarray_set(&pdf->objects, obj->index, NULL);
-    if (pdf->last_objects[type] == obj) {
-        pdf->last_objects[type] = NULL;
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-            struct pdf_object *o = pdf_get_object(pdf, i);
-            if (o && o->type == type)
-                pdf->last_objects[type] = o;
-        }
-    }
 
-    if (pdf->first_objects[type] == obj) {
-        pdf->first_objects[type] = NULL;
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-            struct pdf_object *o = pdf_get_object(pdf, i);
-            if (o && o->type == type) {
-                pdf->first_objects[type] = o;
-                break;
-            }
-        }
-    }
+    /* Unlink it from the list of objects of this type */
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        pdf->first_objects[type] = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+    else
+        pdf->last_objects[type] = obj->prev;
 
     pdf_object_destroy(obj);
+    obj->next = pdf->free_objects[type];
+    pdf->free_objects[type] = obj;
 }
 
 struct pdf_doc *pdf_create(float width, float height,
@@ -769,6 +1422,11 @@ struct pdf_doc *pdf_create(float width, float height,
         pdf_destroy(pdf);
         return NULL;
     }
+    if (!pdf_add_object(pdf, OBJ_font_dict) ||
+        !pdf_add_object(pdf, OBJ_gstate_dict)) {
+        pdf_destroy(pdf);
+        return NULL;
+    }
 
     if (pdf_set_font(pdf, "Times-Roman") < 0) {
         pdf_destroy(pdf);
@@ -801,9 +1459,19 @@ float pdf_page_height(const struct pdf_object *page)
 void pdf_destroy(struct pdf_doc *pdf)
 {
     if (pdf) {
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-            pdf_object_destroy(pdf_get_object(pdf, i));
+        if (pdf->stream_fp) {
+            writer_close(&pdf->stream_writer);
+            fclose(pdf->stream_fp);
+        }
+        free(pdf->stream_filename);
+        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+            struct pdf_object *obj = pdf_get_object(pdf, i);
+            if (obj)
+                pdf_object_destroy(obj);
+        }
         flexarray_clear(&pdf->objects);
+        arena_free(&pdf->arena);
+        free(pdf->image_buckets);
         free(pdf);
     }
 }
@@ -841,8 +1509,11 @@ int pdf_set_font(struct pdf_doc *pdf, const char *font)
         obj = pdf_add_object(pdf, OBJ_font);
         if (!obj)
             return pdf->errval;
-        strncpy(obj->font.name, font, sizeof(obj->font.name) - 1);
-        obj->font.name[sizeof(obj->font.name) - 1] = '\0';
+        obj->font.name = arena_strdup(&pdf->arena, font);
+        if (!obj->font.name) {
+            pdf_del_object(pdf, obj);
+            return pdf_set_err(pdf, -ENOMEM, "Unable to allocate font name");
+        }
         obj->font.index = last_index + 1;
     }
 
@@ -897,6 +1568,37 @@ int pdf_page_set_size(struct pdf_doc *pdf, struct pdf_object *page,
     return 0;
 }
 
+int pdf_clear_pages(struct pdf_doc *pdf)
+{
+    struct pdf_object *obj;
+
+    if (!pdf)
+        return -EINVAL;
+
+    /* Content streams and links belong to exactly one page */
+    while ((obj = pdf_find_first_object(pdf, OBJ_page)) != NULL) {
+        for (int i = 0; i < flexarray_size(&obj->page.children); i++)
+            pdf_del_object(pdf, (struct pdf_object *)flexarray_get(
+                                    &obj->page.children, i));
+        for (int i = 0; i < flexarray_size(&obj->page.annotations); i++)
+            pdf_del_object(pdf, (struct pdf_object *)flexarray_get(
+                                    &obj->page.annotations, i));
+        pdf_del_object(pdf, obj);
+    }
+
+    /* Bookmarks point at pages, so they go too */
+    while ((obj = pdf_find_first_object(pdf, OBJ_bookmark)) != NULL)
+        pdf_del_object(pdf, obj);
+    if ((obj = pdf_find_first_object(pdf, OBJ_outline)) != NULL)
+        pdf_del_object(pdf, obj);
+
+    /* Images stay in the document, ready to be placed again */
+    for (obj = pdf_find_first_object(pdf, OBJ_image); obj; obj = obj->next)
+        obj->stream.placements = 0;
+
+    return 0;
+}
+
 // Recursively scan for the number of children
 static int pdf_get_bookmark_count(const struct pdf_object *obj)
 {
@@ -913,107 +1615,1249 @@ static int pdf_get_bookmark_count(const struct pdf_object *obj)
     return count;
 }
 
-static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
-{
-    struct pdf_object *object = pdf_get_object(pdf, index);
-    if (!object)
-        return -ENOENT;
+/*
+ * Flate compression: a deflate (RFC 1951) encoder inside a zlib (RFC 1950)
+ * wrapper, which is what /FlateDecode expects.
+ * Matches are found with hash chains over a 32K window. The level picks how
+ * far the chains are searched and whether matching is lazy, as in zlib.
+ * Each block is written with dynamic or fixed Huffman codes, or stored,
+ * whichever comes out smallest.
+ */
 
-    if (object->type == OBJ_none)
-        return -ENOENT;
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_TOO_FAR 4096 /* Length 3 matches further back don't pay */
+#define DEFLATE_BLOCK_SYMBOLS 16384
+#define DEFLATE_LITLEN_CODES 286
+#define DEFLATE_FIXED_CODES 288 /* The fixed code also has two unused ones */
+#define DEFLATE_DIST_CODES 30
+#define DEFLATE_CODELEN_CODES 19
 
-    object->offset = ftell(fp);
+static const struct {
+    int chain; /* Hash chain entries to search */
+    int nice;  /* Stop searching at a match this long */
+    bool lazy; /* Look one byte ahead for a longer match */
+} deflate_levels[] = {
+    {0, 0, false},      {4, 8, false},     {8, 16, false},
+    {32, 32, false},    {16, 16, true},    {32, 32, true},
+    {128, 128, true},   {256, 258, true},  {1024, 258, true},
+    {4096, 258, true},
+};
 
-    fprintf(fp, "%d 0 obj\r\n", index);
+static const uint16_t deflate_length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t deflate_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t deflate_dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+static const uint8_t deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t deflate_codelen_order[DEFLATE_CODELEN_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/* A literal (dist == 0) or a length/distance pair */
+struct deflate_symbol {
+    uint16_t value;
+    uint16_t dist;
+};
 
-    switch (object->type) {
-    case OBJ_stream:
-    case OBJ_image: {
-        fwrite(dstr_data(&object->stream.stream),
-               dstr_len(&object->stream.stream), 1, fp);
-        break;
-    }
-    case OBJ_info: {
-        struct pdf_info *info = object->info;
+struct huffman {
+    uint16_t codes[DEFLATE_FIXED_CODES]; /* Bit reversed, ready to write */
+    uint8_t lengths[DEFLATE_FIXED_CODES];
+};
 
-        fprintf(fp, "<<\r\n");
-        if (info->creator[0])
-            fprintf(fp, "  /Creator (%s)\r\n", info->creator);
-        if (info->producer[0])
-            fprintf(fp, "  /Producer (%s)\r\n", info->producer);
-        if (info->title[0])
-            fprintf(fp, "  /Title (%s)\r\n", info->title);
-        if (info->author[0])
-            fprintf(fp, "  /Author (%s)\r\n", info->author);
-        if (info->subject[0])
-            fprintf(fp, "  /Subject (%s)\r\n", info->subject);
-        if (info->date[0])
-            fprintf(fp, "  /CreationDate (D:%s)\r\n", info->date);
-        fprintf(fp, ">>\r\n");
-        break;
-    }
+struct deflate_state {
+    const uint8_t *in;
+    size_t len;
+    int level;
+
+    /* Match finder. Positions are stored + 1, so 0 is an empty slot */
+    uint32_t *head;
+    uint32_t *prev;
+    int hash_bits;
+    size_t prev_mask;
+
+    /* Symbols of the block being collected, and where its input starts */
+    struct deflate_symbol *symbols;
+    int symbol_count;
+    size_t block_start;
+
+    uint8_t length_code[DEFLATE_MAX_MATCH + 1];
+    uint8_t dist_code[512]; /* See deflate_dist_code */
+
+    /* Output */
+    uint8_t *out;
+    size_t out_len;
+    size_t out_alloc;
+    uint64_t bits;
+    int bit_count;
+};
 
-    case OBJ_page: {
-        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
-        bool printed_xobjects = false;
+static int deflate_reserve(struct deflate_state *s, size_t bytes)
+{
+    if (s->out_len + bytes + 8 <= s->out_alloc)
+        return 0;
 
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Page\r\n"
-                "  /Parent %d 0 R\r\n",
-                pages->index);
-        fprintf(fp, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
-                object->page.height);
-        fprintf(fp, "  /Resources <<\r\n");
-        fprintf(fp, "    /Font <<\r\n");
-        for (struct pdf_object *font = pdf_find_first_object(pdf, OBJ_font);
-             font; font = font->next)
-            fprintf(fp, "      /F%d %d 0 R\r\n", font->font.index,
-                    font->index);
-        fprintf(fp, "    >>\r\n");
-        // We trim transparency to just 4-bits
-        fprintf(fp, "    /ExtGState <<\r\n");
-        for (int i = 0; i < 16; i++) {
-            fprintf(fp, "      /GS%d <</ca %f>>\r\n", i,
-                    (float)(15 - i) / 15);
+    size_t alloc = s->out_alloc * 2;
+    if (alloc < s->out_len + bytes + 8)
+        alloc = s->out_len + bytes + 8;
+    uint8_t *out = (uint8_t *)realloc(s->out, alloc);
+    if (!out)
+        return -ENOMEM;
+    s->out = out;
+    s->out_alloc = alloc;
+    return 0;
+}
+
+/* Bits go out least significant first, space is reserved by the caller */
+static inline void deflate_put_bits(struct deflate_state *s, uint32_t value,
+                                    int count)
+{
+    s->bits |= (uint64_t)value << s->bit_count;
+    s->bit_count += count;
+    while (s->bit_count >= 8) {
+        s->out[s->out_len++] = (uint8_t)s->bits;
+        s->bits >>= 8;
+        s->bit_count -= 8;
+    }
+}
+
+static void deflate_align(struct deflate_state *s)
+{
+    if (s->bit_count > 0)
+        deflate_put_bits(s, 0, 8 - s->bit_count);
+}
+
+static inline int deflate_dist_code(const struct deflate_state *s, int dist)
+{
+    dist--;
+    return dist < 256 ? s->dist_code[dist] : s->dist_code[256 + (dist >> 7)];
+}
+
+static void deflate_init_tables(struct deflate_state *s)
+{
+    for (int code = 0; code < 29; code++) {
+        int last = code == 28 ? DEFLATE_MAX_MATCH
+                              : deflate_length_base[code + 1] - 1;
+        /* 258 has a code of its own, rather than being 227 + 31 */
+        if (code == 27)
+            last = 257;
+        for (int len = deflate_length_base[code]; len <= last; len++)
+            s->length_code[len] = (uint8_t)code;
+    }
+    for (int code = 0; code < DEFLATE_DIST_CODES; code++) {
+        int first = deflate_dist_base[code] - 1;
+        int last = first + (1 << deflate_dist_extra[code]);
+        for (int dist = first; dist < last; dist++) {
+            if (dist < 256)
+                s->dist_code[dist] = (uint8_t)code;
+            else
+                s->dist_code[256 + (dist >> 7)] = (uint8_t)code;
         }
-        fprintf(fp, "    >>\r\n");
-
-        for (struct pdf_object *image = pdf_find_first_object(pdf, OBJ_image);
-             image; image = image->next) {
-            if (image->stream.page == object) {
-                if (!printed_xobjects) {
-                    fprintf(fp, "    /XObject <<");
-                    printed_xobjects = true;
-                }
-                fprintf(fp, "      /Image%d %d 0 R ", image->index,
-                        image->index);
+    }
+}
+
+/*
+ * Huffman code lengths for the given symbol frequencies, no longer than
+ * limit. Frequencies are flattened and the tree rebuilt until it fits.
+ * At least two symbols always get a code, so the code is complete.
+ */
+static void huffman_lengths(const uint32_t *freq, int count, int limit,
+                            uint8_t *lengths)
+{
+    uint32_t weight[2 * DEFLATE_LITLEN_CODES];
+    uint16_t parent[2 * DEFLATE_LITLEN_CODES];
+    uint16_t leaves[DEFLATE_LITLEN_CODES];
+    uint8_t depth[2 * DEFLATE_LITLEN_CODES];
+    uint32_t scaled[DEFLATE_LITLEN_CODES];
+    int n = 0;
+
+    for (int i = 0; i < count; i++) {
+        lengths[i] = 0;
+        scaled[i] = freq[i];
+        if (freq[i])
+            n++;
+    }
+    for (int i = 0; n < 2 && i < count; i++) {
+        if (!scaled[i]) {
+            scaled[i] = 1;
+            n++;
+        }
+    }
+
+    for (;;) {
+        /* Leaves sorted by frequency, insertion sort is fine for 286 */
+        n = 0;
+        for (int i = 0; i < count; i++) {
+            if (!scaled[i])
+                continue;
+            int j = n++;
+            while (j > 0 && scaled[leaves[j - 1]] > scaled[i]) {
+                leaves[j] = leaves[j - 1];
+                j--;
+            }
+            leaves[j] = (uint16_t)i;
+        }
+        for (int i = 0; i < n; i++)
+            weight[i] = scaled[leaves[i]];
+
+        /* Internal nodes are made in order of weight, so they form a
+         * second sorted queue next to the leaves */
+        int leaf = 0, node = n;
+        for (int k = n; k < 2 * n - 1; k++) {
+            for (int pick = 0; pick < 2; pick++) {
+                int child;
+                if (leaf < n && (node >= k || weight[leaf] <= weight[node]))
+                    child = leaf++;
+                else
+                    child = node++;
+                parent[child] = (uint16_t)k;
+                weight[k] = pick ? weight[k] + weight[child] : weight[child];
+            }
+        }
+
+        int max_depth = 0;
+        depth[2 * n - 2] = 0;
+        for (int k = 2 * n - 3; k >= 0; k--) {
+            depth[k] = depth[parent[k]] + 1;
+            if (depth[k] > max_depth)
+                max_depth = depth[k];
+        }
+
+        if (max_depth <= limit) {
+            for (int i = 0; i < n; i++)
+                lengths[leaves[i]] = depth[i];
+            return;
+        }
+        for (int i = 0; i < count; i++)
+            if (scaled[i])
+                scaled[i] = (scaled[i] >> 1) | 1;
+    }
+}
+
+/* Canonical codes for the given lengths, bit reversed for writing */
+static void huffman_codes(struct huffman *h, int count)
+{
+    uint16_t length_count[16] = {0};
+    uint16_t next[16];
+    uint16_t code = 0;
+
+    for (int i = 0; i < count; i++)
+        length_count[h->lengths[i]]++;
+    length_count[0] = 0;
+    for (int bits = 1; bits < 16; bits++) {
+        code = (uint16_t)((code + length_count[bits - 1]) << 1);
+        next[bits] = code;
+    }
+    for (int i = 0; i < count; i++) {
+        int len = h->lengths[i];
+        uint16_t c = len ? next[len]++ : 0, reversed = 0;
+        for (int b = 0; b < len; b++)
+            reversed |= (uint16_t)(((c >> b) & 1) << (len - 1 - b));
+        h->codes[i] = reversed;
+    }
+}
+
+static void huffman_fixed(struct huffman *litlen, struct huffman *dist)
+{
+    for (int i = 0; i < DEFLATE_FIXED_CODES; i++)
+        litlen->lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    for (int i = 0; i < DEFLATE_DIST_CODES; i++)
+        dist->lengths[i] = 5;
+    huffman_codes(litlen, DEFLATE_FIXED_CODES);
+    huffman_codes(dist, DEFLATE_DIST_CODES);
+}
+
+/* Bits needed for the block's symbols with the given codes */
+static size_t deflate_symbol_bits(const uint32_t *litlen_freq,
+                                  const uint32_t *dist_freq,
+                                  const struct huffman *litlen,
+                                  const struct huffman *dist)
+{
+    size_t bits = 0;
+
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; i++) {
+        bits += (size_t)litlen_freq[i] * litlen->lengths[i];
+        if (i > 256)
+            bits += (size_t)litlen_freq[i] * deflate_length_extra[i - 257];
+    }
+    for (int i = 0; i < DEFLATE_DIST_CODES; i++)
+        bits += (size_t)dist_freq[i] * (dist->lengths[i] +
+                                        deflate_dist_extra[i]);
+    return bits;
+}
+
+static void deflate_write_symbols(struct deflate_state *s,
+                                  const struct huffman *litlen,
+                                  const struct huffman *dist)
+{
+    for (int i = 0; i < s->symbol_count; i++) {
+        const struct deflate_symbol *sym = &s->symbols[i];
+        if (!sym->dist) {
+            deflate_put_bits(s, litlen->codes[sym->value],
+                             litlen->lengths[sym->value]);
+            continue;
+        }
+        int lc = s->length_code[sym->value];
+        deflate_put_bits(s, litlen->codes[257 + lc], litlen->lengths[257 + lc]);
+        deflate_put_bits(s, sym->value - deflate_length_base[lc],
+                         deflate_length_extra[lc]);
+        int dc = deflate_dist_code(s, sym->dist);
+        deflate_put_bits(s, dist->codes[dc], dist->lengths[dc]);
+        deflate_put_bits(s, sym->dist - deflate_dist_base[dc],
+                         deflate_dist_extra[dc]);
+    }
+    deflate_put_bits(s, litlen->codes[256], litlen->lengths[256]);
+}
+
+/* Writes out the collected symbols, covering the input up to end */
+static int deflate_flush_block(struct deflate_state *s, size_t end, bool last)
+{
+    uint32_t litlen_freq[DEFLATE_LITLEN_CODES] = {0};
+    uint32_t dist_freq[DEFLATE_DIST_CODES] = {0};
+    uint32_t codelen_freq[DEFLATE_CODELEN_CODES] = {0};
+    struct huffman litlen, dist, codelen, fixed_litlen, fixed_dist;
+    uint8_t all_lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    uint8_t rle[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    uint8_t rle_extra[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    int rle_count = 0;
+    int nlitlen = 257, ndist = 1, ncodelen = 4;
+    size_t stored_len = end - s->block_start;
+
+    for (int i = 0; i < s->symbol_count; i++) {
+        const struct deflate_symbol *sym = &s->symbols[i];
+        if (!sym->dist) {
+            litlen_freq[sym->value]++;
+        } else {
+            litlen_freq[257 + s->length_code[sym->value]]++;
+            dist_freq[deflate_dist_code(s, sym->dist)]++;
+        }
+    }
+    litlen_freq[256] = 1;
+
+    huffman_lengths(litlen_freq, DEFLATE_LITLEN_CODES, 15, litlen.lengths);
+    huffman_lengths(dist_freq, DEFLATE_DIST_CODES, 15, dist.lengths);
+    huffman_codes(&litlen, DEFLATE_LITLEN_CODES);
+    huffman_codes(&dist, DEFLATE_DIST_CODES);
+
+    for (int i = 0; i < DEFLATE_LITLEN_CODES; i++)
+        if (litlen.lengths[i])
+            nlitlen = i + 1;
+    for (int i = 0; i < DEFLATE_DIST_CODES; i++)
+        if (dist.lengths[i])
+            ndist = i + 1;
+    memcpy(all_lengths, litlen.lengths, nlitlen);
+    memcpy(all_lengths + nlitlen, dist.lengths, ndist);
+
+    /* Run length encode the code lengths with codes 16-18 */
+    for (int i = 0; i < nlitlen + ndist;) {
+        uint8_t len = all_lengths[i];
+        int run = 1;
+        while (i + run < nlitlen + ndist && all_lengths[i + run] == len)
+            run++;
+        if (len == 0 && run >= 11) {
+            run = run > 138 ? 138 : run;
+            rle[rle_count] = 18;
+            rle_extra[rle_count++] = (uint8_t)(run - 11);
+        } else if (len == 0 && run >= 3) {
+            rle[rle_count] = 17;
+            rle_extra[rle_count++] = (uint8_t)(run - 3);
+        } else if (len != 0 && run >= 4) {
+            run = run > 7 ? 7 : run;
+            rle[rle_count++] = len;
+            rle[rle_count] = 16;
+            rle_extra[rle_count++] = (uint8_t)(run - 4);
+        } else {
+            run = 1;
+            rle[rle_count++] = len;
+        }
+        i += run;
+    }
+    for (int i = 0; i < rle_count; i++)
+        codelen_freq[rle[i]]++;
+    huffman_lengths(codelen_freq, DEFLATE_CODELEN_CODES, 7, codelen.lengths);
+    huffman_codes(&codelen, DEFLATE_CODELEN_CODES);
+    for (int i = 0; i < DEFLATE_CODELEN_CODES; i++)
+        if (codelen.lengths[deflate_codelen_order[i]])
+            ncodelen = i + 1 > ncodelen ? i + 1 : ncodelen;
+
+    size_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * (size_t)ncodelen +
+                          deflate_symbol_bits(litlen_freq, dist_freq, &litlen,
+                                              &dist);
+    for (int i = 0; i < rle_count; i++) {
+        dynamic_bits += codelen.lengths[rle[i]];
+        if (rle[i] >= 16)
+            dynamic_bits += rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7;
+    }
+    huffman_fixed(&fixed_litlen, &fixed_dist);
+    size_t fixed_bits = 3 + deflate_symbol_bits(litlen_freq, dist_freq,
+                                                &fixed_litlen, &fixed_dist);
+    /* Stored blocks hold at most 64K each, with a 4 byte length header */
+    size_t stored_bits =
+        (stored_len / 65535 + 1) * (3 + 7 + 32) + stored_len * 8;
+
+    if (deflate_reserve(s, stored_len + stored_len / 8 + 1024) < 0)
+        return -ENOMEM;
+
+    if (stored_bits <= dynamic_bits && stored_bits <= fixed_bits) {
+        const uint8_t *data = s->in + s->block_start;
+        do {
+            size_t chunk = stored_len > 65535 ? 65535 : stored_len;
+            stored_len -= chunk;
+            deflate_put_bits(s, last && stored_len == 0, 1);
+            deflate_put_bits(s, 0, 2);
+            deflate_align(s);
+            deflate_put_bits(s, (uint32_t)chunk, 16);
+            deflate_put_bits(s, (uint32_t)chunk ^ 0xffff, 16);
+            memcpy(&s->out[s->out_len], data, chunk);
+            s->out_len += chunk;
+            data += chunk;
+        } while (stored_len > 0);
+    } else if (fixed_bits <= dynamic_bits) {
+        deflate_put_bits(s, last, 1);
+        deflate_put_bits(s, 1, 2);
+        deflate_write_symbols(s, &fixed_litlen, &fixed_dist);
+    } else {
+        deflate_put_bits(s, last, 1);
+        deflate_put_bits(s, 2, 2);
+        deflate_put_bits(s, nlitlen - 257, 5);
+        deflate_put_bits(s, ndist - 1, 5);
+        deflate_put_bits(s, ncodelen - 4, 4);
+        for (int i = 0; i < ncodelen; i++)
+            deflate_put_bits(s, codelen.lengths[deflate_codelen_order[i]], 3);
+        for (int i = 0; i < rle_count; i++) {
+            deflate_put_bits(s, codelen.codes[rle[i]],
+                             codelen.lengths[rle[i]]);
+            if (rle[i] >= 16)
+                deflate_put_bits(s, rle_extra[i],
+                                 rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+        }
+        deflate_write_symbols(s, &litlen, &dist);
+    }
+
+    s->symbol_count = 0;
+    s->block_start = end;
+    return 0;
+}
+
+static inline uint32_t deflate_hash(const struct deflate_state *s, size_t pos)
+{
+    const uint8_t *p = &s->in[pos];
+    uint32_t v =
+        (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - s->hash_bits);
+}
+
+static inline void deflate_insert(struct deflate_state *s, size_t pos)
+{
+    if (pos + DEFLATE_MIN_MATCH > s->len)
+        return;
+    uint32_t h = deflate_hash(s, pos);
+    s->prev[pos & s->prev_mask] = s->head[h];
+    s->head[h] = (uint32_t)pos + 1;
+}
+
+/* Longest earlier match for the bytes at pos, 0 if there is none */
+static int deflate_longest_match(const struct deflate_state *s, size_t pos,
+                                 int *dist)
+{
+    size_t avail = s->len - pos;
+    int max = avail < DEFLATE_MAX_MATCH ? (int)avail : DEFLATE_MAX_MATCH;
+    int chain = deflate_levels[s->level].chain;
+    int nice = deflate_levels[s->level].nice;
+    const uint8_t *cur = &s->in[pos];
+    int best = DEFLATE_MIN_MATCH - 1;
+
+    if (max < DEFLATE_MIN_MATCH)
+        return 0;
+    if (nice > max)
+        nice = max;
+
+    uint32_t cand = s->head[deflate_hash(s, pos)];
+    while (cand && chain-- > 0) {
+        size_t from = cand - 1;
+        if (pos - from >= DEFLATE_WINDOW)
+            break;
+        const uint8_t *match = &s->in[from];
+        if (match[best] == cur[best] && match[0] == cur[0]) {
+            int len = 1;
+            while (len < max && match[len] == cur[len])
+                len++;
+            if (len > best) {
+                best = len;
+                *dist = (int)(pos - from);
+                if (len >= nice)
+                    break;
+            }
+        }
+        uint32_t next = s->prev[from & s->prev_mask];
+        /* Entries older than the window may have been reused */
+        if (next >= cand)
+            break;
+        cand = next;
+    }
+
+    if (best < DEFLATE_MIN_MATCH ||
+        (best == DEFLATE_MIN_MATCH && *dist > DEFLATE_TOO_FAR))
+        return 0;
+    return best;
+}
+
+static int deflate_emit(struct deflate_state *s, size_t pos, int len,
+                        int dist)
+{
+    struct deflate_symbol *sym = &s->symbols[s->symbol_count++];
+
+    sym->value = dist ? (uint16_t)len : s->in[pos];
+    sym->dist = (uint16_t)dist;
+    if (s->symbol_count == DEFLATE_BLOCK_SYMBOLS)
+        return deflate_flush_block(s, pos + (dist ? len : 1), false);
+    return 0;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t len)
+{
+    uint32_t a = 1, b = 0;
+
+    while (len > 0) {
+        /* 5552 bytes is the most that can be summed without overflow */
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/*
+ * Compresses len bytes at the given level (1-9) into a zlib stream.
+ * Returns the compressed size with the buffer in *out, to be freed by the
+ * caller, or < 0 on failure
+ */
+static ssize_t pdf_deflate(const uint8_t *in, size_t len, int level,
+                           uint8_t **out)
+{
+    struct deflate_state *s;
+    size_t window = len < DEFLATE_WINDOW ? len : DEFLATE_WINDOW;
+    int prev_len = 0, prev_dist = 0;
+    bool have_prev = false;
+    int e = 0;
+
+    if (level < 1 || level > 9 || len >= UINT32_MAX)
+        return -EINVAL;
+
+    s = (struct deflate_state *)calloc(1, sizeof(*s));
+    if (!s)
+        return -ENOMEM;
+    s->in = in;
+    s->len = len;
+    s->level = level;
+    /* Small streams get a small hash table, clearing it dominates */
+    for (s->hash_bits = 8;
+         s->hash_bits < 15 && ((size_t)1 << s->hash_bits) < len;
+         s->hash_bits++)
+        ;
+    s->prev_mask = DEFLATE_WINDOW - 1;
+    s->head = (uint32_t *)calloc((size_t)1 << s->hash_bits, sizeof(uint32_t));
+    s->prev = (uint32_t *)malloc((window ? window : 1) * sizeof(uint32_t));
+    s->symbols = (struct deflate_symbol *)malloc(
+        DEFLATE_BLOCK_SYMBOLS * sizeof(struct deflate_symbol));
+    s->out_alloc = len / 2 + 64;
+    s->out = (uint8_t *)malloc(s->out_alloc);
+    deflate_init_tables(s);
+    if (!s->head || !s->prev || !s->symbols || !s->out) {
+        e = -ENOMEM;
+        goto out;
+    }
+
+    /* zlib header: 32K window, and the level as a hint */
+    s->out[s->out_len++] = 0x78;
+    s->out[s->out_len++] = level == 1 ? 0x01 : level < 6 ? 0x5e
+                           : level == 6               ? 0x9c
+                                                      : 0xda;
+
+    for (size_t pos = 0; pos < len && e >= 0;) {
+        int dist = 0;
+        int match = 0;
+
+        if (!have_prev || prev_len < deflate_levels[level].nice)
+            match = deflate_longest_match(s, pos, &dist);
+        deflate_insert(s, pos);
+
+        if (!deflate_levels[level].lazy) {
+            if (match) {
+                e = deflate_emit(s, pos, match, dist);
+                for (size_t i = pos + 1; i < pos + match; i++)
+                    deflate_insert(s, i);
+                pos += match;
+            } else {
+                e = deflate_emit(s, pos, 1, 0);
+                pos++;
+            }
+            continue;
+        }
+
+        /* Lazy matching: a match found at the previous byte is only used
+         * if this byte doesn't start a longer one */
+        if (have_prev && prev_len && match <= prev_len) {
+            e = deflate_emit(s, pos - 1, prev_len, prev_dist);
+            for (size_t i = pos + 1; i < pos - 1 + prev_len; i++)
+                deflate_insert(s, i);
+            pos += prev_len - 1;
+            have_prev = false;
+            continue;
+        }
+        if (have_prev)
+            e = deflate_emit(s, pos - 1, 1, 0);
+        prev_len = match;
+        prev_dist = dist;
+        have_prev = true;
+        pos++;
+    }
+    if (e >= 0 && have_prev)
+        e = deflate_emit(s, len - 1, 1, 0);
+    if (e >= 0)
+        e = deflate_flush_block(s, len, true);
+    if (e >= 0)
+        e = deflate_reserve(s, 8);
+    if (e >= 0) {
+        uint32_t adler = adler32(in, len);
+        deflate_align(s);
+        s->out[s->out_len++] = (uint8_t)(adler >> 24);
+        s->out[s->out_len++] = (uint8_t)(adler >> 16);
+        s->out[s->out_len++] = (uint8_t)(adler >> 8);
+        s->out[s->out_len++] = (uint8_t)adler;
+    }
+
+out:
+    free(s->head);
+    free(s->prev);
+    free(s->symbols);
+    if (e < 0) {
+        free(s->out);
+        free(s);
+        return e;
+    }
+    *out = s->out;
+    ssize_t out_len = (ssize_t)s->out_len;
+    free(s);
+    return out_len;
+}
+
+/*
+ * Flate decompression, for PNG images whose pixels have to be rearranged
+ * before they can go into the PDF.
+ * Codes of up to INFLATE_FAST_BITS bits are decoded with a single table
+ * lookup, longer ones bit by bit from the canonical code.
+ */
+
+#define INFLATE_FAST_BITS 10
+
+struct inflate_huffman {
+    uint16_t fast[1 << INFLATE_FAST_BITS]; /* symbol << 4 | length, or 0 */
+    uint16_t count[16];                    /* Number of codes per length */
+    uint16_t symbols[DEFLATE_FIXED_CODES]; /* In canonical code order */
+};
+
+struct inflate_state {
+    const uint8_t *in;
+    size_t len;
+    size_t pos; /* Runs past len while the bit buffer is padded */
+    uint64_t bits;
+    int bit_count;
+
+    uint8_t *out;
+    size_t out_len;
+    size_t out_pos;
+
+    struct inflate_huffman lit;
+    struct inflate_huffman dist;
+    struct inflate_huffman codelen;
+};
+
+static void inflate_refill(struct inflate_state *s)
+{
+    while (s->bit_count <= 56) {
+        if (s->pos < s->len)
+            s->bits |= (uint64_t)s->in[s->pos] << s->bit_count;
+        s->pos++;
+        s->bit_count += 8;
+    }
+}
+
+static uint32_t inflate_bits(struct inflate_state *s, int n)
+{
+    uint32_t v;
+
+    if (s->bit_count < n)
+        inflate_refill(s);
+    v = (uint32_t)(s->bits & ((1u << n) - 1));
+    s->bits >>= n;
+    s->bit_count -= n;
+    return v;
+}
+
+/* True once bits beyond the end of the input have been used */
+static bool inflate_overrun(const struct inflate_state *s)
+{
+    return s->pos * 8 - s->bit_count > s->len * 8;
+}
+
+static int inflate_build(struct inflate_huffman *h, const uint8_t *lengths,
+                         int n)
+{
+    uint16_t offsets[16];
+    int left = 1;
+    unsigned int code = 0;
+    int k = 0;
+
+    memset(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++)
+        h->count[lengths[i]]++;
+    h->count[0] = 0;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return -EINVAL; /* Over-subscribed */
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++)
+        offsets[len + 1] = offsets[len] + h->count[len];
+    for (int i = 0; i < n; i++)
+        if (lengths[i])
+            h->symbols[offsets[lengths[i]]++] = (uint16_t)i;
+
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int len = 1; len <= INFLATE_FAST_BITS; len++) {
+        for (int i = 0; i < h->count[len]; i++, k++, code++) {
+            unsigned int rev = 0;
+            for (int b = 0; b < len; b++)
+                rev |= ((code >> b) & 1) << (len - 1 - b);
+            for (unsigned int j = rev; j < (1u << INFLATE_FAST_BITS);
+                 j += 1u << len)
+                h->fast[j] = (uint16_t)(h->symbols[k] << 4 | len);
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+static int inflate_decode(struct inflate_state *s,
+                          const struct inflate_huffman *h)
+{
+    int code = 0, first = 0, index = 0;
+    uint16_t entry;
+
+    if (s->bit_count < 15)
+        inflate_refill(s);
+    entry = h->fast[s->bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (entry) {
+        s->bits >>= entry & 15;
+        s->bit_count -= entry & 15;
+        return entry >> 4;
+    }
+
+    for (int len = 1; len < 16; len++) {
+        code |= (int)(s->bits >> (len - 1)) & 1;
+        if (code - h->count[len] < first) {
+            s->bits >>= len;
+            s->bit_count -= len;
+            return h->symbols[index + code - first];
+        }
+        index += h->count[len];
+        first = (first + h->count[len]) << 1;
+        code <<= 1;
+    }
+    return -EINVAL;
+}
+
+static int inflate_codes(struct inflate_state *s)
+{
+    while (!inflate_overrun(s)) {
+        int sym = inflate_decode(s, &s->lit);
+        size_t length, distance;
+
+        if (sym < 0)
+            return sym;
+        if (sym < 256) {
+            if (s->out_pos == s->out_len)
+                return -EINVAL;
+            s->out[s->out_pos++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 256)
+            return 0;
+
+        sym -= 257;
+        if (sym >= 29)
+            return -EINVAL;
+        length = deflate_length_base[sym] +
+                 inflate_bits(s, deflate_length_extra[sym]);
+        sym = inflate_decode(s, &s->dist);
+        if (sym < 0 || sym >= DEFLATE_DIST_CODES)
+            return -EINVAL;
+        distance =
+            deflate_dist_base[sym] + inflate_bits(s, deflate_dist_extra[sym]);
+        if (distance > s->out_pos || length > s->out_len - s->out_pos)
+            return -EINVAL;
+
+        /* The source may overlap what is being written */
+        uint8_t *to = &s->out[s->out_pos];
+        const uint8_t *from = to - distance;
+        for (size_t i = 0; i < length; i++)
+            to[i] = from[i];
+        s->out_pos += length;
+    }
+    return -EINVAL;
+}
+
+static int inflate_stored(struct inflate_state *s)
+{
+    size_t len;
+
+    inflate_bits(s, s->bit_count & 7);
+    len = inflate_bits(s, 16);
+    if (inflate_bits(s, 16) != (~len & 0xffff) || inflate_overrun(s) ||
+        len > s->out_len - s->out_pos)
+        return -EINVAL;
+
+    /* Bytes already in the bit buffer first, then straight from the input */
+    for (; len && s->bit_count; len--)
+        s->out[s->out_pos++] = (uint8_t)inflate_bits(s, 8);
+    /* The bit buffer is padded past the end of the input, so pos can be
+     * beyond len once it has been drained */
+    if (inflate_overrun(s) || s->pos > s->len || len > s->len - s->pos)
+        return -EINVAL;
+    memcpy(&s->out[s->out_pos], &s->in[s->pos], len);
+    s->out_pos += len;
+    s->pos += len;
+    return 0;
+}
+
+static int inflate_fixed(struct inflate_state *s)
+{
+    uint8_t lengths[DEFLATE_FIXED_CODES];
+
+    memset(lengths, 8, 144);
+    memset(&lengths[144], 9, 256 - 144);
+    memset(&lengths[256], 7, 280 - 256);
+    memset(&lengths[280], 8, DEFLATE_FIXED_CODES - 280);
+    inflate_build(&s->lit, lengths, DEFLATE_FIXED_CODES);
+    memset(lengths, 5, DEFLATE_DIST_CODES);
+    inflate_build(&s->dist, lengths, DEFLATE_DIST_CODES);
+    return inflate_codes(s);
+}
+
+static int inflate_dynamic(struct inflate_state *s)
+{
+    uint8_t lengths[DEFLATE_LITLEN_CODES + DEFLATE_DIST_CODES];
+    int nlen = inflate_bits(s, 5) + 257;
+    int ndist = inflate_bits(s, 5) + 1;
+    int ncode = inflate_bits(s, 4) + 4;
+
+    if (nlen > DEFLATE_LITLEN_CODES || ndist > DEFLATE_DIST_CODES)
+        return -EINVAL;
+
+    memset(lengths, 0, DEFLATE_CODELEN_CODES);
+    for (int i = 0; i < ncode; i++)
+        lengths[deflate_codelen_order[i]] = (uint8_t)inflate_bits(s, 3);
+    if (inflate_build(&s->codelen, lengths, DEFLATE_CODELEN_CODES) < 0)
+        return -EINVAL;
+
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = inflate_decode(s, &s->codelen);
+        int repeat, len = 0;
+
+        if (sym < 0 || inflate_overrun(s))
+            return -EINVAL;
+        if (sym < 16) {
+            lengths[i++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 16) {
+            if (i == 0)
+                return -EINVAL;
+            len = lengths[i - 1];
+            repeat = 3 + inflate_bits(s, 2);
+        } else if (sym == 17) {
+            repeat = 3 + inflate_bits(s, 3);
+        } else {
+            repeat = 11 + inflate_bits(s, 7);
+        }
+        if (i + repeat > nlen + ndist)
+            return -EINVAL;
+        memset(&lengths[i], len, repeat);
+        i += repeat;
+    }
+
+    if (lengths[256] == 0 || inflate_build(&s->lit, lengths, nlen) < 0 ||
+        inflate_build(&s->dist, &lengths[nlen], ndist) < 0)
+        return -EINVAL;
+    return inflate_codes(s);
+}
+
+/*
+ * Decompresses a zlib stream into out, which it has to fill exactly.
+ * Returns 0 on success, or < 0 for damaged data
+ */
+static int pdf_inflate(const uint8_t *in, size_t len, uint8_t *out,
+                       size_t out_len)
+{
+    struct inflate_state *s;
+    uint32_t adler = 0;
+    int final = 0;
+    int e = 0;
+
+    /* zlib header: deflate with at most a 32K window, no dictionary */
+    if (len < 6 || (in[0] & 0x0f) != 8 || (in[0] >> 4) > 7 ||
+        ((in[0] << 8) | in[1]) % 31 != 0 || (in[1] & 0x20))
+        return -EINVAL;
+
+    s = (struct inflate_state *)calloc(1, sizeof(*s));
+    if (!s)
+        return -ENOMEM;
+    s->in = in + 2;
+    s->len = len - 2;
+    s->out = out;
+    s->out_len = out_len;
+
+    while (!final && e >= 0) {
+        final = inflate_bits(s, 1);
+        switch (inflate_bits(s, 2)) {
+        case 0:
+            e = inflate_stored(s);
+            break;
+        case 1:
+            e = inflate_fixed(s);
+            break;
+        case 2:
+            e = inflate_dynamic(s);
+            break;
+        default:
+            e = -EINVAL;
+        }
+    }
+
+    if (e >= 0) {
+        inflate_bits(s, s->bit_count & 7);
+        for (int i = 0; i < 4; i++)
+            adler = (adler << 8) | inflate_bits(s, 8);
+        if (inflate_overrun(s) || s->out_pos != out_len ||
+            adler != adler32(out, out_len))
+            e = -EINVAL;
+    }
+    free(s);
+    return e;
+}
+
+/* The payload of a stream that can be compressed on save */
+static bool pdf_stream_payload(struct pdf_object *obj, const uint8_t **data,
+                               size_t *len)
+{
+    if (obj->type == OBJ_stream) {
+        *data = (const uint8_t *)dstr_data(&obj->stream.stream);
+        *len = dstr_len(&obj->stream.stream);
+        return true;
+    }
+    if (obj->type == OBJ_image && obj->stream.raw) {
+        *data = obj->stream.data;
+        *len = obj->stream.data_len;
+        return true;
+    }
+    return false;
+}
+
+static void pdf_pack_object(struct pdf_object *obj, int level)
+{
+    const uint8_t *data;
+    uint8_t *packed;
+    ssize_t packed_len;
+    size_t len;
+
+    if (!pdf_stream_payload(obj, &data, &len))
+        return;
+
+    /* Streams that fail to compress, or don't shrink, are written as is */
+    packed_len = pdf_deflate(data, len, level, &packed);
+    if (packed_len < 0)
+        return;
+    if ((size_t)packed_len >= len) {
+        free(packed);
+        return;
+    }
+    obj->stream.packed = packed;
+    obj->stream.packed_len = (size_t)packed_len;
+}
+
+struct pack_queue {
+    struct pdf_object **objs;
+    int count;
+    int next;
+    int level;
+#ifdef PDF_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+#ifdef PDF_THREADS
+#define MAX_PACK_THREADS 64
+
+static void *pdf_pack_worker(void *arg)
+{
+    struct pack_queue *queue = (struct pack_queue *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= queue->count)
+            break;
+        pdf_pack_object(queue->objs[i], queue->level);
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Compresses the streams among objs that are about to be written, when
+ * compression is on. Several streams are spread over the threads given to
+ * pdf_set_compression. objs is used as scratch space.
+ */
+static void pdf_pack_objects(struct pdf_doc *pdf, struct pdf_object **objs,
+                             int count)
+{
+    struct pack_queue queue;
+    const uint8_t *data;
+    size_t len;
+
+    if (pdf->compress_level <= PDF_COMPRESS_NONE)
+        return;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.objs = objs;
+    queue.level = pdf->compress_level;
+
+    for (int i = 0; i < count; i++) {
+        struct pdf_object *obj = objs[i];
+        if (obj && !obj->written && pdf_stream_payload(obj, &data, &len) &&
+            !obj->stream.packed)
+            objs[queue.count++] = obj;
+    }
+
+#ifdef PDF_THREADS
+    int threads = pdf->compress_threads;
+    if (threads > queue.count)
+        threads = queue.count;
+    if (threads > MAX_PACK_THREADS)
+        threads = MAX_PACK_THREADS;
+    if (threads > 1) {
+        pthread_t workers[MAX_PACK_THREADS];
+        int started = 0;
+
+        pthread_mutex_init(&queue.lock, NULL);
+        while (started < threads - 1 &&
+               pthread_create(&workers[started], NULL, pdf_pack_worker,
+                              &queue) == 0)
+            started++;
+        pdf_pack_worker(&queue);
+        for (int i = 0; i < started; i++)
+            pthread_join(workers[i], NULL);
+        pthread_mutex_destroy(&queue.lock);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < queue.count; i++)
+        pdf_pack_object(queue.objs[i], queue.level);
+}
+
+/* Drops compressed copies, so the streams are compressed again on save */
+static void pdf_unpack_objects(struct pdf_doc *pdf, int type)
+{
+    for (struct pdf_object *obj = pdf_find_first_object(pdf, type); obj;
+         obj = obj->next) {
+        free(obj->stream.packed);
+        obj->stream.packed = NULL;
+    }
+}
+
+int pdf_set_object_streams(struct pdf_doc *pdf, int enable)
+{
+    if (!pdf)
+        return -EINVAL;
+    if (pdf->stream_fp)
+        return pdf_set_err(pdf, -EBUSY, "PDF is already being saved");
+
+    pdf->object_streams = enable != 0;
+    return 0;
+}
+
+int pdf_set_compression(struct pdf_doc *pdf, int level, int threads)
+{
+    if (!pdf)
+        return -EINVAL;
+    if (level < PDF_COMPRESS_NONE || level > PDF_COMPRESS_BEST)
+        return pdf_set_err(pdf, -EINVAL, "Invalid compression level %d",
+                           level);
+
+    if (level != pdf->compress_level) {
+        pdf_unpack_objects(pdf, OBJ_stream);
+        pdf_unpack_objects(pdf, OBJ_image);
+    }
+    pdf->compress_level = level;
+    pdf->compress_threads = threads;
+
+    return 0;
+}
+
+/* Writes the value of an object, without the obj/endobj around it */
+static int pdf_save_object_body(struct pdf_doc *pdf, struct pdf_writer *w,
+                                struct pdf_object *object)
+{
+    switch (object->type) {
+    case OBJ_stream:
+        if (object->stream.packed) {
+            writer_printf(w, "<< /Length %zu /Filter /FlateDecode >>stream\r\n",
+                          object->stream.packed_len);
+            writer_write(w, object->stream.packed, object->stream.packed_len);
+        } else {
+            writer_printf(w, "<< /Length %zu >>stream\r\n",
+                          dstr_len(&object->stream.stream));
+            writer_write(w, dstr_data(&object->stream.stream),
+                         dstr_len(&object->stream.stream));
+        }
+        writer_printf(w, "\r\nendstream\r\n");
+        break;
+
+    case OBJ_image: {
+        writer_write(w, dstr_data(&object->stream.stream),
+                     dstr_len(&object->stream.stream));
+        if (object->stream.raw && object->stream.packed) {
+            writer_printf(w,
+                          "  /Filter /FlateDecode\r\n"
+                          "  /Length %zu\r\n"
+                          ">>stream\r\n",
+                          object->stream.packed_len);
+            writer_write(w, object->stream.packed, object->stream.packed_len);
+            writer_printf(w, "\r\nendstream\r\n");
+        } else if (object->stream.raw) {
+            writer_printf(w,
+                          "  /Length %zu\r\n"
+                          ">>stream\r\n",
+                          object->stream.data_len);
+            writer_write(w, object->stream.data, object->stream.data_len);
+            writer_printf(w, "\r\nendstream\r\n");
+        } else if (object->stream.data) {
+            writer_write(w, object->stream.data, object->stream.data_len);
+            writer_printf(w, "\r\nendstream\r\n");
+        } else if (object->stream.path) {
+            struct stat st;
+            int e;
+
+            /* Only the length can be checked without reading it all */
+            if (stat(object->stream.path, &st) < 0)
+                return pdf_set_err(pdf, -errno, "Unable to access '%s': %s",
+                                   object->stream.path, strerror(errno));
+            if ((size_t)st.st_size != object->stream.data_len)
+                return pdf_set_err(pdf, -EINVAL,
+                                   "'%s' has changed since it was loaded",
+                                   object->stream.path);
+            e = writer_copy_file(w, object->stream.path,
+                                 object->stream.data_len);
+            if (e < 0)
+                return pdf_set_err(pdf, e, "Unable to copy '%s': %s",
+                                   object->stream.path, strerror(-e));
+            writer_printf(w, "\r\nendstream\r\n");
+        }
+        break;
+    }
+    case OBJ_info: {
+        struct pdf_info *info = object->info;
+
+        writer_printf(w, "<<\r\n");
+        if (info->creator[0])
+            writer_printf(w, "  /Creator (%s)\r\n", info->creator);
+        if (info->producer[0])
+            writer_printf(w, "  /Producer (%s)\r\n", info->producer);
+        if (info->title[0])
+            writer_printf(w, "  /Title (%s)\r\n", info->title);
+        if (info->author[0])
+            writer_printf(w, "  /Author (%s)\r\n", info->author);
+        if (info->subject[0])
+            writer_printf(w, "  /Subject (%s)\r\n", info->subject);
+        if (info->date[0])
+            writer_printf(w, "  /CreationDate (D:%s)\r\n", info->date);
+        writer_printf(w, ">>\r\n");
+        break;
+    }
+
+    case OBJ_page: {
+        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+        bool printed_xobjects = false;
+
+        writer_printf(w,
+                      "<<\r\n"
+                      "  /Type /Page\r\n"
+                      "  /Parent %d 0 R\r\n",
+                      pages->index);
+        writer_printf(w, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
+                      object->page.height);
+
+        // Pages without images inherit the shared /Resources of the pages
+        // tree. A page's own /Resources replaces that dictionary instead of
+        // extending it, so it repeats the shared references.
+        for (int i = 0; i < flexarray_size(&object->page.images); i++) {
+            struct pdf_object *image =
+                (struct pdf_object *)flexarray_get(&object->page.images, i);
+            if (!printed_xobjects) {
+                writer_printf(
+                    w,
+                    "  /Resources <<\r\n"
+                    "    /Font %d 0 R\r\n"
+                    "    /ExtGState %d 0 R\r\n"
+                    "    /XObject <<",
+                    pdf_find_first_object(pdf, OBJ_font_dict)->index,
+                    pdf_find_first_object(pdf, OBJ_gstate_dict)->index);
+                printed_xobjects = true;
             }
+            writer_printf(w, "      /Image%d %d 0 R ", image->index,
+                          image->index);
         }
         if (printed_xobjects)
-            fprintf(fp, "    >>\r\n");
-        fprintf(fp, "  >>\r\n");
+            writer_printf(w, "    >>\r\n"
+                          "  >>\r\n");
 
-        fprintf(fp, "  /Contents [\r\n");
+        writer_printf(w, "  /Contents [\r\n");
         for (int i = 0; i < flexarray_size(&object->page.children); i++) {
             struct pdf_object *child =
                 (struct pdf_object *)flexarray_get(&object->page.children, i);
-            fprintf(fp, "%d 0 R\r\n", child->index);
+            writer_printf(w, "%d 0 R\r\n", child->index);
         }
-        fprintf(fp, "]\r\n");
+        writer_printf(w, "]\r\n");
 
         if (flexarray_size(&object->page.annotations)) {
-            fprintf(fp, "  /Annots [\r\n");
+            writer_printf(w, "  /Annots [\r\n");
             for (int i = 0; i < flexarray_size(&object->page.annotations);
                  i++) {
                 struct pdf_object *child = (struct pdf_object *)flexarray_get(
                     &object->page.annotations, i);
-                fprintf(fp, "%d 0 R\r\n", child->index);
+                writer_printf(w, "%d 0 R\r\n", child->index);
             }
-            fprintf(fp, "]\r\n");
+            writer_printf(w, "]\r\n");
         }
 
-        fprintf(fp, ">>\r\n");
+        writer_printf(w, ">>\r\n");
         break;
     }
 
@@ -1025,13 +2869,13 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
             parent = pdf_find_first_object(pdf, OBJ_outline);
         if (!object->bookmark.page)
             break;
-        fprintf(fp,
-                "<<\r\n"
-                "  /Dest [%d 0 R /XYZ 0 %f null]\r\n"
-                "  /Parent %d 0 R\r\n"
-                "  /Title (%s)\r\n",
-                object->bookmark.page->index, pdf->height, parent->index,
-                object->bookmark.name);
+        writer_printf(w,
+                      "<<\r\n"
+                      "  /Dest [%d 0 R /XYZ 0 %f null]\r\n"
+                      "  /Parent %d 0 R\r\n"
+                      "  /Title (%s)\r\n",
+                      object->bookmark.page->index, pdf->height, parent->index,
+                      object->bookmark.name);
         int nchildren = flexarray_size(&object->bookmark.children);
         if (nchildren > 0) {
             struct pdf_object *f, *l;
@@ -1039,9 +2883,9 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
                                                    0);
             l = (struct pdf_object *)flexarray_get(&object->bookmark.children,
                                                    nchildren - 1);
-            fprintf(fp, "  /First %d 0 R\r\n", f->index);
-            fprintf(fp, "  /Last %d 0 R\r\n", l->index);
-            fprintf(fp, "  /Count %d\r\n", pdf_get_bookmark_count(object));
+            writer_printf(w, "  /First %d 0 R\r\n", f->index);
+            writer_printf(w, "  /Last %d 0 R\r\n", l->index);
+            writer_printf(w, "  /Count %d\r\n", pdf_get_bookmark_count(object));
         }
         // Find the previous bookmark with the same parent
         for (other = object->prev;
@@ -1049,181 +2893,665 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
              other = other->prev)
             ;
         if (other)
-            fprintf(fp, "  /Prev %d 0 R\r\n", other->index);
+            writer_printf(w, "  /Prev %d 0 R\r\n", other->index);
         // Find the next bookmark with the same parent
         for (other = object->next;
              other && other->bookmark.parent != object->bookmark.parent;
              other = other->next)
             ;
         if (other)
-            fprintf(fp, "  /Next %d 0 R\r\n", other->index);
-        fprintf(fp, ">>\r\n");
+            writer_printf(w, "  /Next %d 0 R\r\n", other->index);
+        writer_printf(w, ">>\r\n");
+        break;
+    }
+
+    case OBJ_outline: {
+        struct pdf_object *first, *last, *cur;
+        first = pdf_find_first_object(pdf, OBJ_bookmark);
+        last = pdf_find_last_object(pdf, OBJ_bookmark);
+
+        if (first && last) {
+            int count = 0;
+            cur = first;
+            while (cur) {
+                if (!cur->bookmark.parent)
+                    count += pdf_get_bookmark_count(cur) + 1;
+                cur = cur->next;
+            }
+
+            /* Bookmark outline */
+            writer_printf(w,
+                          "<<\r\n"
+                          "  /Count %d\r\n"
+                          "  /Type /Outlines\r\n"
+                          "  /First %d 0 R\r\n"
+                          "  /Last %d 0 R\r\n"
+                          ">>\r\n",
+                          count, first->index, last->index);
+        }
+        break;
+    }
+
+    case OBJ_font:
+        writer_printf(w,
+                      "<<\r\n"
+                      "  /Type /Font\r\n"
+                      "  /Subtype /Type1\r\n"
+                      "  /BaseFont /%s\r\n"
+                      "  /Encoding /WinAnsiEncoding\r\n"
+                      ">>\r\n",
+                      object->font.name);
+        break;
+
+    case OBJ_pages: {
+        int npages = 0;
+
+        writer_printf(w, "<<\r\n"
+                      "  /Type /Pages\r\n"
+                      "  /Kids [ ");
+        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
+             page; page = page->next) {
+            npages++;
+            writer_printf(w, "%d 0 R ", page->index);
+        }
+        writer_printf(w, "]\r\n");
+        writer_printf(w, "  /Count %d\r\n", npages);
+        writer_printf(w,
+                      "  /Resources <<\r\n"
+                      "    /Font %d 0 R\r\n"
+                      "    /ExtGState %d 0 R\r\n"
+                      "  >>\r\n",
+                      pdf_find_first_object(pdf, OBJ_font_dict)->index,
+                      pdf_find_first_object(pdf, OBJ_gstate_dict)->index);
+        writer_printf(w, ">>\r\n");
+        break;
+    }
+
+    case OBJ_font_dict:
+        writer_printf(w, "<<\r\n");
+        for (struct pdf_object *font = pdf_find_first_object(pdf, OBJ_font);
+             font; font = font->next)
+            writer_printf(w, "  /F%d %d 0 R\r\n", font->font.index,
+                          font->index);
+        writer_printf(w, ">>\r\n");
+        break;
+
+    case OBJ_gstate_dict:
+        // We trim transparency to just 4-bits
+        writer_printf(w, "<<\r\n");
+        for (int i = 0; i < 16; i++) {
+            writer_printf(w, "  /GS%d <</ca %f>>\r\n", i, (float)(15 - i) / 15);
+        }
+        writer_printf(w, ">>\r\n");
         break;
+
+    case OBJ_catalog: {
+        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
+        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+
+        writer_printf(w, "<<\r\n"
+                      "  /Type /Catalog\r\n");
+        if (outline)
+            writer_printf(w,
+                          "  /Outlines %d 0 R\r\n"
+                          "  /PageMode /UseOutlines\r\n",
+                          outline->index);
+        writer_printf(w,
+                      "  /Pages %d 0 R\r\n"
+                      ">>\r\n",
+                      pages->index);
+        break;
+    }
+
+    case OBJ_link: {
+        writer_printf(w,
+                      "<<\r\n"
+                      "  /Type /Annot\r\n"
+                      "  /Subtype /Link\r\n"
+                      "  /Rect [%f %f %f %f]\r\n"
+                      "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
+                      "  /Border [0 0 0]\r\n"
+                      ">>\r\n",
+                      object->link.llx, object->link.lly, object->link.urx,
+                      object->link.ury, object->link.target_page->index,
+                      object->link.target_x, object->link.target_y);
+        break;
+    }
+
+    default:
+        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
+                           object->type);
+    }
+
+    return 0;
+}
+
+static int pdf_save_object(struct pdf_doc *pdf, struct pdf_writer *w,
+                           int index)
+{
+    struct pdf_object *object = pdf_get_object(pdf, index);
+    int e;
+
+    if (!object)
+        return -ENOENT;
+
+    if (object->type == OBJ_none)
+        return -ENOENT;
+
+    object->offset = (int)w->offset;
+
+    writer_printf(w, "%d 0 obj\r\n", index);
+    e = pdf_save_object_body(pdf, w, object);
+    if (e < 0)
+        return e;
+    writer_printf(w, "endobj\r\n");
+
+    return 0;
+}
+
+// Slightly modified djb2 hash algorithm to get pseudo-random ID
+static uint64_t hash(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *d8 = (const uint8_t *)data;
+    for (; len; len--) {
+        hash = (((hash & 0x03ffffffffffffff) << 5) +
+                (hash & 0x7fffffffffffffff)) +
+               *d8++;
     }
+    return hash;
+}
+
+static void pdf_save_header(struct pdf_doc *pdf, struct pdf_writer *w)
+{
+    /* Object and cross-reference streams are new in PDF 1.5 */
+    writer_printf(w, "%%PDF-1.%d\r\n", pdf->object_streams ? 5 : 4);
+    /* Hibit bytes */
+    writer_printf(w, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+}
+
+/* Compresses every stream not written out yet */
+static void pdf_pack_all(struct pdf_doc *pdf)
+{
+    struct pdf_object **pending;
+    int count = flexarray_size(&pdf->objects);
+
+    if (pdf->compress_level <= PDF_COMPRESS_NONE)
+        return;
+
+    pending = (struct pdf_object **)malloc(count * sizeof(*pending) + 1);
+    if (!pending)
+        return;
+    for (int i = 0; i < count; i++)
+        pending[i] = pdf_get_object(pdf, i);
+    pdf_pack_objects(pdf, pending, count);
+    free(pending);
+}
+
+/* The /Root, /Info and /ID entries of the trailer */
+static void pdf_trailer_entries(struct pdf_doc *pdf, int xref_count,
+                                char *buffer, size_t size)
+{
+    struct pdf_object *catalog = pdf_find_first_object(pdf, OBJ_catalog);
+    struct pdf_object *info = pdf_find_first_object(pdf, OBJ_info);
+    uint64_t id1, id2;
+    time_t now = time(NULL);
+
+    /* Generate document unique IDs */
+    id1 = hash(5381, info->info, sizeof(struct pdf_info));
+    id1 = hash(id1, &xref_count, sizeof(xref_count));
+    id2 = hash(5381, &now, sizeof(now));
+    pdf_format(buffer, size,
+               "/Root %d 0 R\r\n"
+               "/Info %d 0 R\r\n"
+               "/ID [<%16.16llx> <%16.16llx>]\r\n",
+               catalog->index, info->index, (unsigned long long)id1,
+               (unsigned long long)id2);
+}
+
+/* Writes data as stream object index, compressed if that makes it smaller.
+ * dict holds the other entries of the stream dictionary */
+static void pdf_save_data_object(struct pdf_doc *pdf, struct pdf_writer *w,
+                                 int index, const char *dict,
+                                 const uint8_t *data, size_t len)
+{
+    int level = pdf->compress_level > PDF_COMPRESS_NONE
+                    ? pdf->compress_level
+                    : PDF_COMPRESS_DEFAULT;
+    uint8_t *packed = NULL;
+    ssize_t packed_len = pdf_deflate(data, len, level, &packed);
+
+    writer_printf(w, "%d 0 obj\r\n<<\r\n%s", index, dict);
+    if (packed_len >= 0 && (size_t)packed_len < len) {
+        writer_printf(w, "/Filter /FlateDecode\r\n");
+        data = packed;
+        len = (size_t)packed_len;
+    }
+    writer_printf(w, "/Length %zu\r\n>>stream\r\n", len);
+    writer_write(w, data, len);
+    writer_printf(w, "\r\nendstream\r\nendobj\r\n");
+    free(packed);
+}
+
+#define OBJSTM_MAX_OBJECTS 100 /* Keeps lookups in viewers cheap */
+
+/* Writes objs as the members of object stream index */
+static int pdf_save_object_stream(struct pdf_doc *pdf, struct pdf_writer *w,
+                                  int index, struct pdf_object **objs,
+                                  int count)
+{
+    struct dstr offsets = INIT_DSTR;
+    struct pdf_writer body;
+    char dict[128];
+    uint8_t *data = NULL;
+    int e = 0;
+
+    /* The members are rendered by the same code as plain objects, into
+     * memory */
+    writer_init(&body, NULL, NULL);
+    for (int i = 0; i < count && e >= 0; i++) {
+        size_t start = body.offset;
+        dstr_printf(&offsets, "%d %zu ", objs[i]->index, start);
+        e = pdf_save_object_body(pdf, &body, objs[i]);
+        if (body.offset == start)
+            writer_printf(&body, "null");
+        writer_printf(&body, "\r\n");
+    }
+    if (e >= 0 && body.error >= 0)
+        data = (uint8_t *)malloc(dstr_len(&offsets) + body.used);
+    if (e >= 0 && !data)
+        e = pdf_set_err(pdf, -ENOMEM, "Unable to allocate object stream");
+
+    if (e >= 0) {
+        memcpy(data, dstr_data(&offsets), dstr_len(&offsets));
+        memcpy(&data[dstr_len(&offsets)], body.buffer, body.used);
+        pdf_format(dict, sizeof(dict),
+                   "/Type /ObjStm\r\n"
+                   "/N %d\r\n"
+                   "/First %zu\r\n",
+                   count, dstr_len(&offsets));
+        pdf_save_data_object(pdf, w, index, dict, data,
+                             dstr_len(&offsets) + body.used);
+    }
+    free(data);
+    writer_close(&body);
+    dstr_free(&offsets);
+    return e;
+}
+
+static void put_xref_entry(uint8_t *entry, int type, uint32_t field2,
+                           uint16_t field3)
+{
+    entry[0] = (uint8_t)type;
+    entry[1] = (uint8_t)(field2 >> 24);
+    entry[2] = (uint8_t)(field2 >> 16);
+    entry[3] = (uint8_t)(field2 >> 8);
+    entry[4] = (uint8_t)field2;
+    entry[5] = (uint8_t)(field3 >> 8);
+    entry[6] = (uint8_t)field3;
+}
+
+/*
+ * PDF 1.5 tail: streams are written as plain objects, everything else is
+ * packed into object streams, and a cross-reference stream replaces the
+ * xref table and trailer
+ */
+static int pdf_save_compact_tail(struct pdf_doc *pdf, struct pdf_writer *w)
+{
+    int count = flexarray_size(&pdf->objects);
+    struct pdf_object **members;
+    int *slot; /* Position of each object among the members, or -1 */
+    int nmembers = 0, nstreams, xref_index, xref_offset;
+    int xref_count = 0;
+    long *stream_offsets = NULL;
+    uint8_t *entries = NULL;
+    char dict[512], trailer[256];
+    int e = 0;
+
+    members = (struct pdf_object **)malloc(count * sizeof(*members) + 1);
+    slot = (int *)malloc(count * sizeof(*slot) + 1);
+    if (!members || !slot) {
+        e = pdf_set_err(pdf, -ENOMEM, "Unable to allocate object list");
+        goto out;
+    }
+
+    for (int i = 0; i < count && e >= 0; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        slot[i] = -1;
+        if (!obj || obj->type == OBJ_none)
+            continue;
+        xref_count++;
+        if (obj->type != OBJ_stream && obj->type != OBJ_image) {
+            slot[i] = nmembers;
+            members[nmembers++] = obj;
+        } else if (!obj->written) {
+            e = pdf_save_object(pdf, w, i);
+        }
+    }
+
+    nstreams = (nmembers + OBJSTM_MAX_OBJECTS - 1) / OBJSTM_MAX_OBJECTS;
+    stream_offsets = (long *)malloc(nstreams * sizeof(*stream_offsets) + 1);
+    if (e >= 0 && !stream_offsets)
+        e = pdf_set_err(pdf, -ENOMEM, "Unable to allocate object streams");
+    for (int s = 0; s < nstreams && e >= 0; s++) {
+        int first = s * OBJSTM_MAX_OBJECTS;
+        int n = nmembers - first < OBJSTM_MAX_OBJECTS ? nmembers - first
+                                                      : OBJSTM_MAX_OBJECTS;
+        stream_offsets[s] = (long)w->offset;
+        e = pdf_save_object_stream(pdf, w, count + s, &members[first], n);
+    }
+    if (e < 0)
+        goto out;
+
+    /* Entries are type, offset or object stream, and generation or index
+     * within the object stream, in 1, 4 and 2 bytes */
+    xref_index = count + nstreams;
+    xref_offset = (int)w->offset;
+    entries = (uint8_t *)malloc((size_t)(xref_index + 1) * 7);
+    if (!entries) {
+        e = pdf_set_err(pdf, -ENOMEM, "Unable to allocate xref stream");
+        goto out;
+    }
+    put_xref_entry(entries, 0, 0, 65535);
+    for (int i = 1; i < count; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (!obj || obj->type == OBJ_none)
+            put_xref_entry(&entries[i * 7], 0, 0, 1);
+        else if (slot[i] >= 0)
+            put_xref_entry(&entries[i * 7], 2,
+                           count + slot[i] / OBJSTM_MAX_OBJECTS,
+                           slot[i] % OBJSTM_MAX_OBJECTS);
+        else
+            put_xref_entry(&entries[i * 7], 1, obj->offset, 0);
+    }
+    for (int s = 0; s < nstreams; s++)
+        put_xref_entry(&entries[(count + s) * 7], 1, stream_offsets[s], 0);
+    put_xref_entry(&entries[xref_index * 7], 1, xref_offset, 0);
+
+    pdf_trailer_entries(pdf, xref_count, trailer, sizeof(trailer));
+    pdf_format(dict, sizeof(dict),
+               "/Type /XRef\r\n"
+               "/Size %d\r\n"
+               "/W [1 4 2]\r\n"
+               "%s",
+               xref_index + 1, trailer);
+    pdf_save_data_object(pdf, w, xref_index, dict, entries,
+                         (size_t)(xref_index + 1) * 7);
+    writer_printf(w, "startxref\r\n"
+                  "%d\r\n"
+                  "%%%%EOF\r\n",
+                  xref_offset);
+
+out:
+    free(entries);
+    free(stream_offsets);
+    free(slot);
+    free(members);
+    return e;
+}
+
+/* Writes every object not streamed out yet, then the xref and trailer */
+static int pdf_save_tail(struct pdf_doc *pdf, struct pdf_writer *w)
+{
+    struct pdf_object *obj;
+    int xref_offset;
+    int xref_count = 0;
+    char trailer[256];
+
+    pdf_pack_all(pdf);
+    if (pdf->object_streams)
+        return pdf_save_compact_tail(pdf, w);
 
-    case OBJ_outline: {
-        struct pdf_object *first, *last, *cur;
-        first = pdf_find_first_object(pdf, OBJ_bookmark);
-        last = pdf_find_last_object(pdf, OBJ_bookmark);
+    /* Dump all the objects & get their file offsets */
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        int e;
 
-        if (first && last) {
-            int count = 0;
-            cur = first;
-            while (cur) {
-                if (!cur->bookmark.parent)
-                    count += pdf_get_bookmark_count(cur) + 1;
-                cur = cur->next;
-            }
+        obj = pdf_get_object(pdf, i);
+        if (!obj || obj->type == OBJ_none)
+            continue;
+        if (!obj->written && (e = pdf_save_object(pdf, w, i)) < 0)
+            return e;
+        xref_count++;
+    }
 
-            /* Bookmark outline */
-            fprintf(fp,
-                    "<<\r\n"
-                    "  /Count %d\r\n"
-                    "  /Type /Outlines\r\n"
-                    "  /First %d 0 R\r\n"
-                    "  /Last %d 0 R\r\n"
-                    ">>\r\n",
-                    count, first->index, last->index);
-        }
-        break;
+    /* xref, with deleted objects listed as free entries */
+    xref_offset = (int)w->offset;
+    writer_printf(w, "xref\r\n");
+    writer_printf(w, "0 %d\r\n", flexarray_size(&pdf->objects));
+    writer_printf(w, "0000000000 65535 f\r\n");
+    for (int i = 1; i < flexarray_size(&pdf->objects); i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj)
+            writer_printf(w, "%10.10d 00000 n\r\n", obj->offset);
+        else
+            writer_printf(w, "0000000000 00001 f\r\n");
     }
 
-    case OBJ_font:
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Font\r\n"
-                "  /Subtype /Type1\r\n"
-                "  /BaseFont /%s\r\n"
-                "  /Encoding /WinAnsiEncoding\r\n"
-                ">>\r\n",
-                object->font.name);
-        break;
+    pdf_trailer_entries(pdf, xref_count, trailer, sizeof(trailer));
+    writer_printf(w,
+                  "trailer\r\n"
+                  "<<\r\n"
+                  "/Size %d\r\n"
+                  "%s",
+                  flexarray_size(&pdf->objects), trailer);
+    writer_printf(w, ">>\r\n"
+                  "startxref\r\n");
+    writer_printf(w, "%d\r\n", xref_offset);
+    writer_printf(w, "%%%%EOF\r\n");
 
-    case OBJ_pages: {
-        int npages = 0;
+    return 0;
+}
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Pages\r\n"
-                    "  /Kids [ ");
-        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
-             page; page = page->next) {
-            npages++;
-            fprintf(fp, "%d 0 R ", page->index);
-        }
-        fprintf(fp, "]\r\n");
-        fprintf(fp, "  /Count %d\r\n", npages);
-        fprintf(fp, ">>\r\n");
-        break;
-    }
+/* Saves the whole document through w, and releases it */
+static int pdf_save_writer(struct pdf_doc *pdf, struct pdf_writer *w)
+{
+    int e;
 
-    case OBJ_catalog: {
-        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
-        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+    pdf_save_header(pdf, w);
+    e = pdf_save_tail(pdf, w);
+    if (writer_close(w) < 0 && e >= 0)
+        e = pdf_set_err(pdf, w->error, "Unable to write PDF: %s",
+                        strerror(-w->error));
+    return e;
+}
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Catalog\r\n");
-        if (outline)
-            fprintf(fp,
-                    "  /Outlines %d 0 R\r\n"
-                    "  /PageMode /UseOutlines\r\n",
-                    outline->index);
-        fprintf(fp,
-                "  /Pages %d 0 R\r\n"
-                ">>\r\n",
-                pages->index);
-        break;
-    }
+int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+{
+    struct pdf_writer w;
 
-    case OBJ_link: {
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Annot\r\n"
-                "  /Subtype /Link\r\n"
-                "  /Rect [%f %f %f %f]\r\n"
-                "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
-                "  /Border [0 0 0]\r\n"
-                ">>\r\n",
-                object->link.llx, object->link.lly, object->link.urx,
-                object->link.ury, object->link.target_page->index,
-                object->link.target_x, object->link.target_y);
-        break;
+    writer_init_file(&w, fp);
+    return pdf_save_writer(pdf, &w);
+}
+
+int pdf_save_callback(struct pdf_doc *pdf, pdf_write_func write,
+                      void *opaque)
+{
+    struct pdf_writer w;
+
+    if (!pdf || !write)
+        return -EINVAL;
+    writer_init(&w, write, opaque);
+    return pdf_save_writer(pdf, &w);
+}
+
+int pdf_save_memory(struct pdf_doc *pdf, uint8_t **data, size_t *len)
+{
+    struct pdf_writer w;
+    int e;
+
+    if (!pdf || !data || !len)
+        return -EINVAL;
+    writer_init(&w, NULL, NULL);
+    pdf_save_header(pdf, &w);
+    e = pdf_save_tail(pdf, &w);
+    if (e >= 0 && w.error < 0)
+        e = pdf_set_err(pdf, w.error, "Unable to write PDF: %s",
+                        strerror(-w.error));
+    if (e < 0) {
+        writer_close(&w);
+        return e;
     }
+    /* The buffer holds the whole document, hand it over */
+    *data = (uint8_t *)w.buffer;
+    *len = w.used;
+    return e;
+}
 
-    default:
-        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
-                           object->type);
+int pdf_save_begin(struct pdf_doc *pdf, const char *filename)
+{
+    if (pdf->stream_fp)
+        return pdf_set_err(pdf, -EBUSY, "PDF is already being saved");
+
+    pdf->stream_filename = strdup(filename);
+    if (!pdf->stream_filename)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to allocate filename");
+
+    if ((pdf->stream_fp = fopen(filename, "wb")) == NULL) {
+        free(pdf->stream_filename);
+        pdf->stream_filename = NULL;
+        return pdf_set_err(pdf, -errno, "Unable to open '%s': %s", filename,
+                           strerror(errno));
     }
 
-    fprintf(fp, "endobj\r\n");
+    writer_init_file(&pdf->stream_writer, pdf->stream_fp);
+    pdf_save_header(pdf, &pdf->stream_writer);
+    return 0;
+}
+
+static void pdf_unindex_image(struct pdf_doc *pdf, struct pdf_object *image);
+
+/* Writes out an object and drops its stream data, which is no longer needed */
+static int pdf_flush_object(struct pdf_doc *pdf, struct pdf_object *obj)
+{
+    int e;
 
+    if (obj->written)
+        return 0;
+    /* Pages go into an object stream at the end, they are only sealed */
+    if (pdf->object_streams && obj->type == OBJ_page) {
+        obj->written = true;
+        return 0;
+    }
+    e = pdf_save_object(pdf, &pdf->stream_writer, obj->index);
+    if (e < 0)
+        return e;
+    obj->written = true;
+
+    if (obj->type == OBJ_stream || obj->type == OBJ_image) {
+        dstr_free(&obj->stream.stream);
+        free(obj->stream.data);
+        obj->stream.data = NULL;
+        free(obj->stream.packed);
+        obj->stream.packed = NULL;
+    }
+    /* With its data gone, an image can only be shared if it has a file */
+    if (obj->type == OBJ_image && !obj->stream.path) {
+        pdf_unindex_image(pdf, obj);
+        free(obj->stream.source);
+        obj->stream.source = NULL;
+    }
+    if (obj->type == OBJ_image && obj->stream.smask)
+        return pdf_flush_object(pdf, obj->stream.smask);
     return 0;
 }
 
-// Slightly modified djb2 hash algorithm to get pseudo-random ID
-static uint64_t hash(uint64_t hash, const void *data, size_t len)
+/* Compresses the contents and images of the pages from first up to last */
+static void pdf_pack_pages(struct pdf_doc *pdf, struct pdf_object *first,
+                           struct pdf_object *last)
 {
-    const uint8_t *d8 = (const uint8_t *)data;
-    for (; len; len--) {
-        hash = (((hash & 0x03ffffffffffffff) << 5) +
-                (hash & 0x7fffffffffffffff)) +
-               *d8++;
+    struct pdf_object **pending;
+    int count = 0;
+
+    if (pdf->compress_level <= PDF_COMPRESS_NONE)
+        return;
+
+    for (struct pdf_object *page = first; page && page != last;
+         page = page->next)
+        count += 2 * flexarray_size(&page->page.images) +
+                 flexarray_size(&page->page.children);
+    pending = (struct pdf_object **)malloc(count * sizeof(*pending) + 1);
+    if (!pending)
+        return;
+
+    count = 0;
+    for (struct pdf_object *page = first; page && page != last;
+         page = page->next) {
+        /* An image can be on several of the pages, but must only be
+         * compressed once */
+        for (int i = 0; i < flexarray_size(&page->page.images); i++) {
+            struct pdf_object *image = (struct pdf_object *)flexarray_get(
+                &page->page.images, i);
+            bool seen = false;
+            for (int j = 0; j < count && !seen; j++)
+                seen = pending[j] == image;
+            if (seen)
+                continue;
+            pending[count++] = image;
+            if (image->stream.smask)
+                pending[count++] = image->stream.smask;
+        }
+        for (int i = 0; i < flexarray_size(&page->page.children); i++)
+            pending[count++] = (struct pdf_object *)flexarray_get(
+                &page->page.children, i);
     }
-    return hash;
+    pdf_pack_objects(pdf, pending, count);
+    free(pending);
 }
 
-int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+int pdf_flush_pages(struct pdf_doc *pdf)
 {
-    struct pdf_object *obj;
-    int xref_offset;
-    int xref_count = 0;
-    uint64_t id1, id2;
-    time_t now = time(NULL);
-    char saved_locale[32];
+    struct pdf_object *last = pdf_find_last_object(pdf, OBJ_page);
+    int e = 0;
+
+    if (!pdf->stream_fp)
+        return pdf_set_err(pdf, -EINVAL, "PDF is not being streamed");
+
+    /* Written pages are always a prefix of the list, so only the pages
+     * added since the last flush need looking at */
+    struct pdf_object *first = last;
+    while (first && first->prev && !first->prev->written)
+        first = first->prev;
+
+    pdf_pack_pages(pdf, first, last);
+
+    for (struct pdf_object *page = first; page && page != last && e >= 0;
+         page = page->next) {
+        for (int i = 0; i < flexarray_size(&page->page.images) && e >= 0; i++)
+            e = pdf_flush_object(pdf, (struct pdf_object *)flexarray_get(
+                                          &page->page.images, i));
+        for (int i = 0; i < flexarray_size(&page->page.children) && e >= 0;
+             i++)
+            e = pdf_flush_object(pdf, (struct pdf_object *)flexarray_get(
+                                          &page->page.children, i));
+        if (e >= 0)
+            e = pdf_flush_object(pdf, page);
+    }
+
+    if (e >= 0 && pdf->stream_writer.error < 0)
+        e = pdf_set_err(pdf, pdf->stream_writer.error,
+                        "Unable to write '%s': %s", pdf->stream_filename,
+                        strerror(-pdf->stream_writer.error));
+    return e;
+}
 
-    force_locale(saved_locale, sizeof(saved_locale));
+int pdf_save_end(struct pdf_doc *pdf)
+{
+    int e;
 
-    fprintf(fp, "%%PDF-1.3\r\n");
-    /* Hibit bytes */
-    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+    if (!pdf->stream_fp)
+        return pdf_set_err(pdf, -EINVAL, "PDF is not being streamed");
 
-    /* Dump all the objects & get their file offsets */
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-        if (pdf_save_object(pdf, fp, i) >= 0)
-            xref_count++;
-
-    /* xref */
-    xref_offset = ftell(fp);
-    fprintf(fp, "xref\r\n");
-    fprintf(fp, "0 %d\r\n", xref_count + 1);
-    fprintf(fp, "0000000000 65535 f\r\n");
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-        obj = pdf_get_object(pdf, i);
-        if (obj->type != OBJ_none)
-            fprintf(fp, "%10.10d 00000 n\r\n", obj->offset);
-    }
-
-    fprintf(fp,
-            "trailer\r\n"
-            "<<\r\n"
-            "/Size %d\r\n",
-            xref_count + 1);
-    obj = pdf_find_first_object(pdf, OBJ_catalog);
-    fprintf(fp, "/Root %d 0 R\r\n", obj->index);
-    obj = pdf_find_first_object(pdf, OBJ_info);
-    fprintf(fp, "/Info %d 0 R\r\n", obj->index);
-    /* Generate document unique IDs */
-    id1 = hash(5381, obj->info, sizeof(struct pdf_info));
-    id1 = hash(id1, &xref_count, sizeof(xref_count));
-    id2 = hash(5381, &now, sizeof(now));
-    fprintf(fp, "/ID [<%16.16" PRIx64 "> <%16.16" PRIx64 ">]\r\n", id1, id2);
-    fprintf(fp, ">>\r\n"
-                "startxref\r\n");
-    fprintf(fp, "%d\r\n", xref_offset);
-    fprintf(fp, "%%%%EOF\r\n");
+    e = pdf_save_tail(pdf, &pdf->stream_writer);
+    if (writer_close(&pdf->stream_writer) < 0 && e >= 0)
+        e = pdf_set_err(pdf, pdf->stream_writer.error,
+                        "Unable to write '%s': %s", pdf->stream_filename,
+                        strerror(-pdf->stream_writer.error));
 
-    restore_locale(saved_locale);
+    if (fclose(pdf->stream_fp) != 0 && e >= 0)
+        e = pdf_set_err(pdf, -errno, "Unable to close '%s': %s",
+                        pdf->stream_filename, strerror(errno));
+    pdf->stream_fp = NULL;
 
-    return 0;
+    return e;
 }
 
 int pdf_save(struct pdf_doc *pdf, const char *filename)
@@ -1259,26 +3587,42 @@ static int pdf_add_stream(struct pdf_doc *pdf, struct pdf_object *page,
     if (!page)
         return pdf_set_err(pdf, -EINVAL, "Invalid pdf page");
 
+    if (page->written)
+        return pdf_set_err(pdf, -EINVAL, "Page has already been written");
+
     len = strlen(buffer);
     /* We don't want any trailing whitespace in the stream */
     while (len >= 1 && (buffer[len - 1] == '\r' || buffer[len - 1] == '\n'))
         len--;
 
-    obj = pdf_add_object(pdf, OBJ_stream);
-    if (!obj)
-        return pdf->errval;
+    /* All drawing on a page goes into one content stream, created by the
+     * first draw call */
+    if (flexarray_size(&page->page.children) == 0) {
+        obj = pdf_add_object(pdf, OBJ_stream);
+        if (!obj)
+            return pdf->errval;
+        obj->stream.page = page;
+        if (flexarray_append(&page->page.children, obj) < 0) {
+            pdf_del_object(pdf, obj);
+            return pdf_set_err(pdf, -ENOMEM, "Unable to add page content");
+        }
+    } else {
+        obj = (struct pdf_object *)flexarray_get(&page->page.children, 0);
+        dstr_append(&obj->stream.stream, "\r\n");
+    }
 
-    dstr_printf(&obj->stream.stream, "<< /Length %zu >>stream\r\n", len);
-    dstr_append_data(&obj->stream.stream, buffer, len);
-    dstr_append(&obj->stream.stream, "\r\nendstream\r\n");
+    if (dstr_append_data(&obj->stream.stream, buffer, len) < 0)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to grow page content");
+    free(obj->stream.packed);
+    obj->stream.packed = NULL;
 
-    return flexarray_append(&page->page.children, obj);
+    return 0;
 }
 
 int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
                      const char *name)
 {
-    struct pdf_object *obj, *outline = NULL;
+    struct pdf_object *obj, *outline = NULL, *parent_obj = NULL;
 
     if (!page)
         page = pdf_find_last_object(pdf, OBJ_page);
@@ -1287,6 +3631,14 @@ int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
         return pdf_set_err(pdf, -EINVAL,
                            "Unable to add bookmark, no pages available");
 
+    /* Checked before anything is added, so a bad parent leaves no trace */
+    if (parent >= 0) {
+        parent_obj = pdf_get_object(pdf, parent);
+        if (!parent_obj || parent_obj->type != OBJ_bookmark)
+            return pdf_set_err(pdf, -EINVAL, "Invalid parent ID %d supplied",
+                               parent);
+    }
+
     if (!pdf_find_first_object(pdf, OBJ_outline)) {
         outline = pdf_add_object(pdf, OBJ_outline);
         if (!outline)
@@ -1300,14 +3652,15 @@ int pdf_add_bookmark(struct pdf_doc *pdf, struct pdf_object *page, int parent,
         return pdf->errval;
     }
 
-    strncpy(obj->bookmark.name, name, sizeof(obj->bookmark.name) - 1);
-    obj->bookmark.name[sizeof(obj->bookmark.name) - 1] = '\0';
+    obj->bookmark.name = arena_strdup(&pdf->arena, name);
+    if (!obj->bookmark.name) {
+        pdf_del_object(pdf, obj);
+        if (outline)
+            pdf_del_object(pdf, outline);
+        return pdf_set_err(pdf, -ENOMEM, "Unable to allocate bookmark name");
+    }
     obj->bookmark.page = page;
-    if (parent >= 0) {
-        struct pdf_object *parent_obj = pdf_get_object(pdf, parent);
-        if (!parent_obj)
-            return pdf_set_err(pdf, -EINVAL, "Invalid parent ID %d supplied",
-                               parent);
+    if (parent_obj) {
         obj->bookmark.parent = parent_obj;
         flexarray_append(&parent_obj->bookmark.children, obj);
     }
@@ -3178,90 +5531,75 @@ int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
     }
 }
 
-static pdf_object *pdf_add_raw_grayscale8(struct pdf_doc *pdf,
-                                          const uint8_t *data, uint32_t width,
-                                          uint32_t height)
+/* Uncompressed 8-bit pixels, the header is completed when saving.
+ * Takes ownership of pixels, which is freed on failure */
+static struct pdf_object *pdf_add_pixel_buffer(struct pdf_doc *pdf,
+                                               uint8_t *pixels,
+                                               uint32_t width,
+                                               uint32_t height, int ncolours)
 {
     struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height;
+    size_t data_len = (size_t)width * (size_t)height * ncolours;
+
+    obj = pdf_add_object(pdf, OBJ_image);
+    if (!obj) {
+        free(pixels);
+        return NULL;
+    }
 
-    dstr_printf(&str,
+    dstr_printf(&obj->stream.stream,
                 "<<\r\n"
                 "  /Type /XObject\r\n"
                 "  /Name /Image%d\r\n"
                 "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceGray\r\n"
+                "  /ColorSpace %s\r\n"
                 "  /Height %d\r\n"
                 "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
+                "  /BitsPerComponent 8\r\n",
+                obj->index, ncolours == 1 ? "/DeviceGray" : "/DeviceRGB",
+                height, width);
+    obj->stream.data = pixels;
+    obj->stream.data_len = data_len;
+    obj->stream.raw = true;
+    obj->stream.width = width;
+    obj->stream.height = height;
+
+    return obj;
+}
+
+static struct pdf_object *pdf_add_raw_pixels(struct pdf_doc *pdf,
+                                             const uint8_t *data,
+                                             uint32_t width, uint32_t height,
+                                             int ncolours)
+{
+    size_t data_len = (size_t)width * (size_t)height * ncolours;
+    uint8_t *pixels;
 
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
+    pixels = (uint8_t *)malloc(data_len ? data_len : 1);
+    if (!pixels) {
         pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
+                    "Unable to allocate %zu bytes memory for image",
+                    data_len);
         return NULL;
     }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
+    memcpy(pixels, data, data_len);
 
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        dstr_free(&str);
-        return NULL;
-    }
-    obj->stream.stream = str;
+    return pdf_add_pixel_buffer(pdf, pixels, width, height, ncolours);
+}
 
-    return obj;
+static struct pdf_object *pdf_add_raw_grayscale8(struct pdf_doc *pdf,
+                                                 const uint8_t *data,
+                                                 uint32_t width,
+                                                 uint32_t height)
+{
+    return pdf_add_raw_pixels(pdf, data, width, height, 1);
 }
 
 static struct pdf_object *pdf_add_raw_rgb24(struct pdf_doc *pdf,
                                             const uint8_t *data,
                                             uint32_t width, uint32_t height)
 {
-    struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height * 3;
-
-    dstr_printf(&str,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceRGB\r\n"
-                "  /Height %d\r\n"
-                "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
-
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
-        pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
-        return NULL;
-    }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
-
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        dstr_free(&str);
-        return NULL;
-    }
-    obj->stream.stream = str;
-
-    return obj;
+    return pdf_add_raw_pixels(pdf, data, width, height, 3);
 }
 
 static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
@@ -3308,9 +5646,9 @@ static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
     return file_data;
 }
 
-static struct pdf_object *
-pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
-                      const uint8_t *jpeg_data, size_t len)
+static struct pdf_object *pdf_add_jpeg_object(struct pdf_doc *pdf,
+                                              const struct pdf_img_info *info,
+                                              size_t len)
 {
     struct pdf_object *obj = pdf_add_object(pdf, OBJ_image);
     if (!obj)
@@ -3331,10 +5669,42 @@ pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
                 flexarray_size(&pdf->objects),
                 (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB",
                 info->width, info->height, len);
-    dstr_append_data(&obj->stream.stream, jpeg_data, len);
+    obj->stream.width = info->width;
+    obj->stream.height = info->height;
+
+    return obj;
+}
+
+// The JPEG bytes become the stream payload as they are, without a copy
+static struct pdf_object *
+pdf_add_raw_jpeg_buffer(struct pdf_doc *pdf, const struct pdf_img_info *info,
+                        uint8_t *jpeg_data, size_t len)
+{
+    struct pdf_object *obj = pdf_add_jpeg_object(pdf, info, len);
+    if (!obj)
+        return NULL;
+
+    obj->stream.data = jpeg_data;
+    obj->stream.data_len = len;
+
+    return obj;
+}
 
-    dstr_printf(&obj->stream.stream, "\r\nendstream\r\n");
+static struct pdf_object *
+pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
+                      const uint8_t *jpeg_data, size_t len)
+{
+    struct pdf_object *obj;
+    uint8_t *copy = (uint8_t *)malloc(len);
 
+    if (!copy) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate JPEG data %zu", len);
+        return NULL;
+    }
+    memcpy(copy, jpeg_data, len);
+    obj = pdf_add_raw_jpeg_buffer(pdf, info, copy, len);
+    if (!obj)
+        free(copy);
     return obj;
 }
 
@@ -3378,6 +5748,47 @@ static int get_img_display_dimensions(struct pdf_doc *pdf, uint32_t img_width,
     return 0;
 }
 
+static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
+                         struct pdf_object *image, float x, float y,
+                         float width, float height);
+
+int pdf_place_image(struct pdf_doc *pdf, struct pdf_object *page,
+                    struct pdf_object *image, float x, float y,
+                    float display_width, float display_height)
+{
+    if (!image || image->type != OBJ_image)
+        return pdf_set_err(pdf, -EINVAL, "Invalid image object");
+
+    if (get_img_display_dimensions(pdf, image->stream.width,
+                                   image->stream.height, &display_width,
+                                   &display_height))
+        return pdf->errval;
+
+    return pdf_add_image(pdf, page, image, x, y, display_width,
+                         display_height);
+}
+
+int pdf_del_image(struct pdf_doc *pdf, struct pdf_object *image)
+{
+    if (!image || image->type != OBJ_image)
+        return pdf_set_err(pdf, -EINVAL, "Invalid image object");
+
+    /* Loads of the same data share the object, the last one removes it */
+    if (image->stream.shares > 0) {
+        image->stream.shares--;
+        return 0;
+    }
+
+    if (image->stream.placements > 0)
+        return pdf_set_err(pdf, -EBUSY, "image is still on a page");
+
+    pdf_unindex_image(pdf, image);
+    if (image->stream.smask)
+        pdf_del_object(pdf, image->stream.smask);
+    pdf_del_object(pdf, image);
+    return 0;
+}
+
 static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
                          struct pdf_object *image, float x, float y,
                          float width, float height)
@@ -3396,10 +5807,20 @@ static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
                            "adding an image, but wrong object type %d",
                            image->type);
 
-    if (image->stream.page != NULL)
-        return pdf_set_err(pdf, -EEXIST, "image already on a page");
+    if (page->written)
+        return pdf_set_err(pdf, -EINVAL, "Page has already been written");
 
-    image->stream.page = page;
+    /* An image drawn more than once on a page is listed once in its
+     * resources */
+    bool listed = false;
+    for (int i = 0; i < flexarray_size(&page->page.images) && !listed; i++)
+        listed = flexarray_get(&page->page.images, i) == image;
+    if (!listed) {
+        ret = flexarray_append(&page->page.images, image);
+        if (ret < 0)
+            return pdf_set_err(pdf, ret, "Unable to add image to page");
+    }
+    image->stream.placements++;
 
     dstr_append(&str, "q ");
     dstr_printf(&str, "%f 0 0 %f %f %f cm ", width, height, x, y);
@@ -3495,11 +5916,10 @@ static int parse_ppm_header(struct pdf_img_info *info, const uint8_t *data,
     return 0;
 }
 
-static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *ppm_data, size_t len)
+static struct pdf_object *pdf_load_ppm_data(struct pdf_doc *pdf,
+                                            const struct pdf_img_info *info,
+                                            const uint8_t *ppm_data,
+                                            size_t len)
 {
     char line[1024];
     // We start reading at the position delivered by parse_ppm_header,
@@ -3507,37 +5927,36 @@ static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
     size_t pos = info->ppm.data_begin_pos;
 
     /* Skip over the byte-size line */
-    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1))
-        return pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
+    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1)) {
+        pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
+        return NULL;
+    }
 
     /* Try and limit the memory usage to sane images */
     if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid width/height in PPM file: %ux%u",
-                           info->width, info->height);
+        pdf_set_err(pdf, -EINVAL, "Invalid width/height in PPM file: %ux%u",
+                    info->width, info->height);
+        return NULL;
     }
 
     if (info->ppm.size > len - pos) {
-        return pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
+        pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
+        return NULL;
     }
 
     switch (info->ppm.color_space) {
     case PPM_BINARY_COLOR_GRAY:
-        return pdf_add_grayscale8(pdf, page, x, y, display_width,
-                                  display_height, &ppm_data[pos], info->width,
-                                  info->height);
-        break;
+        return pdf_add_raw_grayscale8(pdf, &ppm_data[pos], info->width,
+                                      info->height);
 
     case PPM_BINARY_COLOR_RGB:
-        return pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                             &ppm_data[pos], info->width, info->height);
-        break;
+        return pdf_add_raw_rgb24(pdf, &ppm_data[pos], info->width,
+                                 info->height);
 
     default:
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid color space in ppm file: %i",
-                           info->ppm.color_space);
-        break;
+        pdf_set_err(pdf, -EINVAL, "Invalid color space in ppm file: %i",
+                    info->ppm.color_space);
+        return NULL;
     }
 }
 
@@ -3564,32 +5983,14 @@ static int parse_jpeg_header(struct pdf_img_info *info, const uint8_t *data,
                     info->width = data[i + 6] * 256 + data[i + 7];
                     info->jpeg.ncolours = data[i + 8];
                     return 0;
-                }
-                break;
-            }
-            i += len;
-        }
-    }
-    snprintf(err_msg, err_msg_length, "Error parsing JPEG header");
-    return -EINVAL;
-}
-
-static int pdf_add_jpeg_data(struct pdf_doc *pdf, struct pdf_object *page,
-                             float x, float y, float display_width,
-                             float display_height, struct pdf_img_info *info,
-                             const uint8_t *jpeg_data, size_t len)
-{
-    struct pdf_object *obj;
-
-    obj = pdf_add_raw_jpeg_data(pdf, info, jpeg_data, len);
-    if (!obj)
-        return pdf->errval;
-
-    if (get_img_display_dimensions(pdf, info->width, info->height,
-                                   &display_width, &display_height)) {
-        return pdf->errval;
+                }
+                break;
+            }
+            i += len;
+        }
     }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+    snprintf(err_msg, err_msg_length, "Error parsing JPEG header");
+    return -EINVAL;
 }
 
 int pdf_add_rgb24(struct pdf_doc *pdf, struct pdf_object *page, float x,
@@ -3678,13 +6079,224 @@ static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
     return -EINVAL;
 }
 
-static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *img_info,
-                            const uint8_t *png_data, size_t png_data_length)
+static const char png_stream_end[] = "\r\nendstream\r\n";
+
+/* Second pass over a PNG that pdf_load_png_data has checked and sized:
+ * appends the payloads of the IDAT chunks, in order */
+static void png_append_idat(struct dstr *out, const uint8_t *png_data,
+                            size_t png_data_length)
+{
+    size_t pos = sizeof(png_signature);
+
+    while (1) {
+        const struct png_chunk *chunk =
+            (const struct png_chunk *)&png_data[pos];
+        const uint32_t chunk_length = ntoh32(chunk->length);
+
+        pos += sizeof(struct png_chunk);
+        if (strncmp(chunk->type, png_chunk_end, 4) == 0)
+            break;
+        if (strncmp(chunk->type, png_chunk_data, 4) == 0 &&
+            chunk_length > 0 && chunk_length < png_data_length - pos)
+            dstr_append_data(out, &png_data[pos], chunk_length);
+        pos += chunk_length + sizeof(uint32_t);
+    }
+}
+
+/* Undoes the PNG row filters in place. rows holds height rows, each a
+ * filter type byte followed by row_len bytes, with bpp bytes per pixel */
+static int png_unfilter(uint8_t *rows, uint32_t height, size_t row_len,
+                        size_t bpp)
+{
+    const uint8_t *prior = NULL;
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = &rows[(size_t)y * (row_len + 1)];
+        uint8_t *cur = row + 1;
+
+        switch (row[0]) {
+        case 0: // None
+            break;
+        case 1: // Sub
+            for (size_t i = bpp; i < row_len; i++)
+                cur[i] += cur[i - bpp];
+            break;
+        case 2: // Up
+            if (prior)
+                for (size_t i = 0; i < row_len; i++)
+                    cur[i] += prior[i];
+            break;
+        case 3: // Average
+            for (size_t i = 0; i < row_len; i++) {
+                int a = i >= bpp ? cur[i - bpp] : 0;
+                int b = prior ? prior[i] : 0;
+                cur[i] += (uint8_t)((a + b) / 2);
+            }
+            break;
+        case 4: // Paeth
+            for (size_t i = 0; i < row_len; i++) {
+                int a = i >= bpp ? cur[i - bpp] : 0;
+                int b = prior ? prior[i] : 0;
+                int c = prior && i >= bpp ? prior[i - bpp] : 0;
+                int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+                if (pa <= pb && pa <= pc)
+                    cur[i] += (uint8_t)a;
+                else if (pb <= pc)
+                    cur[i] += (uint8_t)b;
+                else
+                    cur[i] += (uint8_t)c;
+            }
+            break;
+        default:
+            return -EINVAL;
+        }
+        prior = cur;
+    }
+    return 0;
+}
+
+/* Splits one row of interleaved colour + alpha samples into the colour and
+ * alpha planes. 16-bit samples keep their high byte. The common 8-bit
+ * layouts get loops of their own, which the compiler can vectorise */
+static void png_split_row(const uint8_t *src, uint32_t width, int ncolours,
+                          int bytes, uint8_t *colour, uint8_t *alpha)
+{
+    const size_t stride = (size_t)(ncolours + 1) * bytes;
+
+    if (bytes == 1 && ncolours == 3) {
+        for (uint32_t x = 0; x < width; x++) {
+            colour[x * 3] = src[x * 4];
+            colour[x * 3 + 1] = src[x * 4 + 1];
+            colour[x * 3 + 2] = src[x * 4 + 2];
+            alpha[x] = src[x * 4 + 3];
+        }
+    } else if (bytes == 1 && ncolours == 1) {
+        for (uint32_t x = 0; x < width; x++) {
+            colour[x] = src[x * 2];
+            alpha[x] = src[x * 2 + 1];
+        }
+    } else {
+        for (uint32_t x = 0; x < width; x++) {
+            const uint8_t *pixel = &src[x * stride];
+            for (int c = 0; c < ncolours; c++)
+                colour[x * ncolours + c] = pixel[c * bytes];
+            alpha[x] = pixel[ncolours * bytes];
+        }
+    }
+}
+
+/*
+ * PDF has no predictor for interleaved alpha, so RGBA and grey + alpha PNGs
+ * are decompressed here and split into an 8-bit colour image with a
+ * greyscale /SMask soft mask
+ */
+static struct pdf_object *
+pdf_load_png_alpha(struct pdf_doc *pdf, const struct png_header *header,
+                   int ncolours, const uint8_t *png_data,
+                   size_t png_data_length, size_t idat_length)
+{
+    const int bytes = header->bitDepth / 8;
+    const size_t pixel_len = (size_t)(ncolours + 1) * bytes;
+    const uint32_t width = header->width, height = header->height;
+    struct dstr idat = INIT_DSTR;
+    struct pdf_object *obj = NULL, *smask = NULL;
+    uint8_t *rows = NULL, *colour = NULL, *alpha = NULL;
+    size_t row_len, rows_len;
+    int e;
+
+    if (header->bitDepth != 8 && header->bitDepth != 16) {
+        pdf_set_err(pdf, -EINVAL, "PNG with alpha has unsupported depth %d",
+                    header->bitDepth);
+        return NULL;
+    }
+    if (header->interlace != 0) {
+        pdf_set_err(pdf, -EINVAL, "Interlaced PNG with alpha unsupported");
+        return NULL;
+    }
+    if (width == 0 || height == 0 ||
+        width > (SIZE_MAX - 1) / pixel_len / height) {
+        pdf_set_err(pdf, -EINVAL, "PNG image size invalid: %ux%u", width,
+                    height);
+        return NULL;
+    }
+    row_len = width * pixel_len;
+    rows_len = (row_len + 1) * height;
+    /* Deflate shrinks data by at most 1032:1, less means a damaged file
+     * rather than one worth allocating rows_len bytes for */
+    if (rows_len / 1032 > idat_length) {
+        pdf_set_err(pdf, -EINVAL, "PNG image data too short");
+        return NULL;
+    }
+
+    if (dstr_reserve(&idat, idat_length) < 0)
+        goto nomem;
+    png_append_idat(&idat, png_data, png_data_length);
+    rows = (uint8_t *)malloc(rows_len);
+    if (!rows)
+        goto nomem;
+    e = pdf_inflate((const uint8_t *)dstr_data(&idat), dstr_len(&idat), rows,
+                    rows_len);
+    dstr_free(&idat);
+    if (e == -ENOMEM)
+        goto nomem;
+    if (e < 0 || png_unfilter(rows, height, row_len, pixel_len) < 0) {
+        pdf_set_err(pdf, -EINVAL, "PNG image data is damaged");
+        goto fail;
+    }
+
+    colour = (uint8_t *)malloc((size_t)width * height * ncolours);
+    alpha = (uint8_t *)malloc((size_t)width * height);
+    if (!colour || !alpha)
+        goto nomem;
+    for (uint32_t y = 0; y < height; y++)
+        png_split_row(&rows[(size_t)y * (row_len + 1) + 1], width, ncolours,
+                      bytes, &colour[(size_t)y * width * ncolours],
+                      &alpha[(size_t)y * width]);
+    free(rows);
+    rows = NULL;
+
+    smask = pdf_add_pixel_buffer(pdf, alpha, width, height, 1);
+    alpha = NULL;
+    if (!smask)
+        goto fail;
+    obj = pdf_add_pixel_buffer(pdf, colour, width, height, ncolours);
+    colour = NULL;
+    if (!obj)
+        goto fail;
+    dstr_printf(&obj->stream.stream,
+                "  /Interpolate true\r\n"
+                "  /SMask %d 0 R\r\n",
+                smask->index);
+    obj->stream.smask = smask;
+
+    /* The PNG was compressed, so keep it that way even when other raw
+     * images are written as they are */
+    if (pdf->compress_level <= PDF_COMPRESS_NONE) {
+        pdf_pack_object(obj, PDF_COMPRESS_DEFAULT);
+        pdf_pack_object(smask, PDF_COMPRESS_DEFAULT);
+    }
+    return obj;
+
+nomem:
+    pdf_set_err(pdf, -ENOMEM, "Unable to allocate %zu bytes for PNG image",
+                rows_len);
+fail:
+    dstr_free(&idat);
+    free(rows);
+    free(colour);
+    free(alpha);
+    if (smask)
+        pdf_del_object(pdf, smask);
+    return NULL;
+}
+
+static struct pdf_object *pdf_load_png_data(struct pdf_doc *pdf,
+                                            const struct pdf_img_info *img_info,
+                                            const uint8_t *png_data,
+                                            size_t png_data_length)
 {
-    // indicates if we return an error or add the img at the
+    // indicates if we return an error or the image at the
     // end of the function
     bool success = false;
 
@@ -3693,12 +6305,10 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
     struct dstr colour_space = INIT_DSTR;
 
     struct pdf_object *obj = NULL;
-    uint8_t *final_data = NULL;
-    int written = 0;
     uint32_t pos;
-    uint8_t *png_data_temp = NULL;
     size_t png_data_total_length = 0;
     uint8_t ncolours;
+    bool alpha = false;
 
     // Stores palette information for indexed PNGs
     struct rgb_value *palette_buffer = NULL;
@@ -3717,7 +6327,14 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
     case PNG_COLOR_INDEXED:
         ncolours = 1;
         break;
-    // PNG_COLOR_RGBA and PNG_COLOR_GREYSCALE_A are unsupported
+    case PNG_COLOR_GREYSCALE_A:
+        ncolours = 1;
+        alpha = true;
+        break;
+    case PNG_COLOR_RGBA:
+        ncolours = 3;
+        alpha = true;
+        break;
     default:
         pdf_set_err(pdf, -EINVAL, "PNG has unsupported color type: %d",
                     header->colorType);
@@ -3798,19 +6415,10 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
                 goto free_buffers;
             }
         } else if (strncmp(chunk->type, png_chunk_data, 4) == 0) {
-            if (chunk_length > 0 && chunk_length < png_data_length - pos) {
-                uint8_t *data = (uint8_t *)realloc(
-                    png_data_temp, png_data_total_length + chunk_length);
-                // (uint8_t *)realloc(info.data, info.length + chunk_length);
-                if (!data) {
-                    pdf_set_err(pdf, -ENOMEM, "No memory for PNG data");
-                    goto free_buffers;
-                }
-                png_data_temp = data;
-                memcpy(&png_data_temp[png_data_total_length], &png_data[pos],
-                       chunk_length);
+            // Only sized here, png_append_idat copies them once the
+            // object has room for all of them
+            if (chunk_length > 0 && chunk_length < png_data_length - pos)
                 png_data_total_length += chunk_length;
-            }
         } else if (strncmp(chunk->type, png_chunk_end, 4) == 0) {
             /* end of file, exit */
             break;
@@ -3831,6 +6439,13 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
         goto free_buffers;
     }
 
+    if (alpha) {
+        obj = pdf_load_png_alpha(pdf, header, ncolours, png_data,
+                                 png_data_length, png_data_total_length);
+        success = obj != NULL;
+        goto free_buffers;
+    }
+
     switch (header->colorType) {
     case PNG_COLOR_GREYSCALE:
         dstr_append(&colour_space, "/DeviceGray");
@@ -3868,17 +6483,13 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
         break;
     }
 
-    final_data = (uint8_t *)malloc(png_data_total_length + 1024 +
-                                   dstr_len(&colour_space));
-    if (!final_data) {
-        pdf_set_err(pdf, -ENOMEM, "Unable to allocate PNG data %zu",
-                    png_data_total_length + 1024 + dstr_len(&colour_space));
+    obj = pdf_add_object(pdf, OBJ_image);
+    if (!obj) {
         goto free_buffers;
     }
 
     // Write image information to PDF
-    written =
-        sprintf((char *)final_data,
+    dstr_printf(&obj->stream.stream,
                 "<<\r\n"
                 "  /Type /XObject\r\n"
                 "  /Name /Image%d\r\n"
@@ -3893,41 +6504,30 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
                 "/BitsPerComponent %u /Columns %u >>\r\n"
                 "  /Length %zu\r\n"
                 ">>stream\r\n",
-                flexarray_size(&pdf->objects), dstr_data(&colour_space),
-                header->width, header->height, header->bitDepth, ncolours,
-                header->bitDepth, header->width, png_data_total_length);
-
-    memcpy(&final_data[written], png_data_temp, png_data_total_length);
-    written += png_data_total_length;
-    written += sprintf((char *)&final_data[written], "\r\nendstream\r\n");
-
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        goto free_buffers;
-    }
-
-    dstr_append_data(&obj->stream.stream, final_data, written);
-
-    if (get_img_display_dimensions(pdf, header->width, header->height,
-                                   &display_width, &display_height)) {
+                obj->index, dstr_data(&colour_space), header->width,
+                header->height, header->bitDepth, ncolours, header->bitDepth,
+                header->width, png_data_total_length);
+    if (dstr_reserve(&obj->stream.stream,
+                     png_data_total_length + strlen(png_stream_end)) < 0) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate PNG data %zu",
+                    png_data_total_length);
         goto free_buffers;
     }
+    png_append_idat(&obj->stream.stream, png_data, png_data_length);
+    dstr_append(&obj->stream.stream, png_stream_end);
+    obj->stream.width = header->width;
+    obj->stream.height = header->height;
     success = true;
 
 free_buffers:
-    if (final_data)
-        free(final_data);
     if (palette_buffer)
         free(palette_buffer);
-    if (png_data_temp)
-        free(png_data_temp);
     dstr_free(&colour_space);
 
-    if (success)
-        return pdf_add_image(pdf, page, obj, x, y, display_width,
-                             display_height);
-    else
-        return pdf->errval;
+    if (!success && obj)
+        pdf_del_object(pdf, obj);
+
+    return success ? obj : NULL;
 }
 
 static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
@@ -3960,18 +6560,162 @@ static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
     return 0;
 }
 
-static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *data, const size_t len)
+/*
+ * BMP rows hold BGR or BGRX pixels, and PDF wants RGB. A row converter
+ * turns width pixels from src into dst, with variants for the vector
+ * units the CPU has. They stop short of the row end wherever a full
+ * vector would run past it, and leave the rest to the scalar loop.
+ */
+typedef void (*bmp_row_func)(uint8_t *dst, const uint8_t *src,
+                             uint32_t width);
+
+static void bmp_bgr24_row(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x * 3] = src[x * 3 + 2];
+        dst[x * 3 + 1] = src[x * 3 + 1];
+        dst[x * 3 + 2] = src[x * 3];
+    }
+}
+
+static void bmp_bgrx32_row(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        dst[x * 3] = src[x * 4 + 2];
+        dst[x * 3 + 1] = src[x * 4 + 1];
+        dst[x * 3 + 2] = src[x * 4];
+    }
+}
+
+#ifdef PDF_X86_SIMD
+/* pshufb masks taking 5 BGR or 4 BGRX pixels to RGB, zeroing the rest */
+#define BMP_BGR24_SHUFFLE                                                    \
+    2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, -1
+#define BMP_BGRX32_SHUFFLE                                                   \
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+__attribute__((target("ssse3"))) static void
+bmp_bgr24_row_ssse3(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const __m128i mask = _mm_setr_epi8(BMP_BGR24_SHUFFLE);
+    uint32_t x = 0;
+
+    for (; x + 6 <= width; x += 5) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[x * 3]);
+        _mm_storeu_si128((__m128i *)&dst[x * 3], _mm_shuffle_epi8(v, mask));
+    }
+    bmp_bgr24_row(&dst[x * 3], &src[x * 3], width - x);
+}
+
+__attribute__((target("ssse3"))) static void
+bmp_bgrx32_row_ssse3(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const __m128i mask = _mm_setr_epi8(BMP_BGRX32_SHUFFLE);
+    uint32_t x = 0;
+
+    for (; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[x * 4]);
+        _mm_storeu_si128((__m128i *)&dst[x * 3], _mm_shuffle_epi8(v, mask));
+    }
+    bmp_bgrx32_row(&dst[x * 3], &src[x * 4], width - x);
+}
+
+/* vpshufb stays within 128-bit lanes, so each lane converts 4 pixels into
+ * its low 12 bytes and vpermd closes the gap between them */
+__attribute__((target("avx2"))) static void
+bmp_bgr24_row_avx2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const __m256i mask = _mm256_setr_epi8(
+        2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1, 2, 1, 0, 5, 4,
+        3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    uint32_t x = 0;
+
+    for (; x + 11 <= width; x += 8) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)&src[x * 3])),
+            _mm_loadu_si128((const __m128i *)&src[x * 3 + 12]), 1);
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), pack);
+        _mm256_storeu_si256((__m256i *)&dst[x * 3], v);
+    }
+    bmp_bgr24_row(&dst[x * 3], &src[x * 3], width - x);
+}
+
+__attribute__((target("avx2"))) static void
+bmp_bgrx32_row_avx2(uint8_t *dst, const uint8_t *src, uint32_t width)
+{
+    const __m256i mask = _mm256_setr_epi8(BMP_BGRX32_SHUFFLE,
+                                          BMP_BGRX32_SHUFFLE);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    uint32_t x = 0;
+
+    for (; x + 11 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[x * 4]);
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), pack);
+        _mm256_storeu_si256((__m256i *)&dst[x * 3], v);
+    }
+    bmp_bgrx32_row(&dst[x * 3], &src[x * 4], width - x);
+}
+#endif
+
+#ifdef PDF_NEON
+static void bmp_bgr24_row_neon(uint8_t *dst, const uint8_t *src,
+                               uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t v = vld3q_u8(&src[x * 3]);
+        uint8x16_t blue = v.val[0];
+        v.val[0] = v.val[2];
+        v.val[2] = blue;
+        vst3q_u8(&dst[x * 3], v);
+    }
+    bmp_bgr24_row(&dst[x * 3], &src[x * 3], width - x);
+}
+
+static void bmp_bgrx32_row_neon(uint8_t *dst, const uint8_t *src,
+                                uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t v = vld4q_u8(&src[x * 4]);
+        uint8x16x3_t rgb = {{v.val[2], v.val[1], v.val[0]}};
+        vst3q_u8(&dst[x * 3], rgb);
+    }
+    bmp_bgrx32_row(&dst[x * 3], &src[x * 4], width - x);
+}
+#endif
+
+/* The fastest row converter the CPU can run, for 3 or 4 bytes per pixel */
+static bmp_row_func bmp_row_converter(uint32_t bpp)
+{
+#ifdef PDF_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return bpp == 3 ? bmp_bgr24_row_avx2 : bmp_bgrx32_row_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return bpp == 3 ? bmp_bgr24_row_ssse3 : bmp_bgrx32_row_ssse3;
+#endif
+#ifdef PDF_NEON
+    return bpp == 3 ? bmp_bgr24_row_neon : bmp_bgrx32_row_neon;
+#endif
+    return bpp == 3 ? bmp_bgr24_row : bmp_bgrx32_row;
+}
+
+static int pdf_load_bmp_data(struct pdf_doc *pdf,
+                             const struct pdf_img_info *info,
+                             const uint8_t *data, const size_t len,
+                             struct pdf_object **image)
 {
     const struct bmp_header *header = &info->bmp;
     uint8_t *bmp_data = NULL;
-    uint8_t row_padding;
+    bmp_row_func convert;
     uint32_t bpp;
+    size_t row_len;
     size_t data_len;
-    int retval;
     const uint32_t width = info->width;
     const uint32_t height = info->height;
 
@@ -3997,71 +6741,33 @@ static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
                            header->biBitCount);
     bpp = header->biBitCount / 8;
     /* BMP rows are 4-bytes padded! */
-    row_padding = (width * bpp) & 3;
+    row_len = ((size_t)width * bpp + 3) & ~(size_t)3;
     data_len = (size_t)width * (size_t)height * 3;
 
     if (header->bfOffBits >= len)
         return pdf_set_err(pdf, -EINVAL, "Invalid BMP image offset");
 
-    if (len - header->bfOffBits <
-        (size_t)height * (width + row_padding) * bpp)
+    if (len - header->bfOffBits < (size_t)height * row_len)
         return pdf_set_err(pdf, -EINVAL, "Wrong BMP image size");
 
-    if (bpp == 3) {
-        /* 24 bits: change R and B colors */
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
-        for (uint32_t pos = 0; pos < width * height; pos++) {
-            uint32_t src_pos =
-                header->bfOffBits + 3 * (pos + (pos / width) * row_padding);
-
-            bmp_data[pos * 3] = data[src_pos + 2];
-            bmp_data[pos * 3 + 1] = data[src_pos + 1];
-            bmp_data[pos * 3 + 2] = data[src_pos];
-        }
-    } else if (bpp == 4) {
-        /* 32 bits: change R and B colors, remove key color */
-        int offs = 0;
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
-
-        for (uint32_t pos = 0; pos < width * height * 4; pos += 4) {
-            bmp_data[offs] = data[header->bfOffBits + pos + 2];
-            bmp_data[offs + 1] = data[header->bfOffBits + pos + 1];
-            bmp_data[offs + 2] = data[header->bfOffBits + pos];
-            offs += 3;
-        }
-    } else {
-        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
-                           header->biBitCount);
-    }
-    if (header->biHeight >= 0) {
-        // BMP has vertically mirrored representation of lines, so swap them
-        uint8_t *line = (uint8_t *)malloc(width * 3);
-        if (!line) {
-            free(bmp_data);
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Unable to allocate memory for bitmap mirror");
-        }
-        for (uint32_t pos = 0; pos < (height / 2); pos++) {
-            memcpy(line, &bmp_data[pos * width * 3], width * 3);
-            memcpy(&bmp_data[pos * width * 3],
-                   &bmp_data[(height - pos - 1) * width * 3], width * 3);
-            memcpy(&bmp_data[(height - pos - 1) * width * 3], line,
-                   width * 3);
-        }
-        free(line);
+    bmp_data = (uint8_t *)malloc(data_len);
+    if (!bmp_data)
+        return pdf_set_err(pdf, -ENOMEM, "Insufficient memory for bitmap");
+
+    /* Swap R and B (dropping the key byte of 32-bit pixels), and since a
+     * positive height stores the rows bottom up, mirror them in the same
+     * pass */
+    convert = bmp_row_converter(bpp);
+    for (uint32_t y = 0; y < height; y++) {
+        uint32_t src_y = header->biHeight >= 0 ? height - y - 1 : y;
+
+        convert(&bmp_data[(size_t)y * width * 3],
+                &data[header->bfOffBits + src_y * row_len], width);
     }
 
-    retval = pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                           bmp_data, width, height);
-    free(bmp_data);
+    *image = pdf_add_pixel_buffer(pdf, bmp_data, width, height, 3);
 
-    return retval;
+    return *image ? 0 : pdf->errval;
 }
 
 static int determine_image_format(const uint8_t *data, size_t length)
@@ -4109,10 +6815,202 @@ int pdf_parse_image_header(struct pdf_img_info *info, const uint8_t *data,
     }
 }
 
-int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                       float y, float display_width, float display_height,
-                       const uint8_t *data, size_t len)
+/*
+ * Image data is hashed to spot images that are loaded more than once. This
+ * is the xxHash64 scheme: four independent lanes take 32 bytes per round,
+ * which keeps the multipliers busy and lets compilers vectorise the loop
+ */
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+#define HASH_PRIME4 0x85ebca77c2b2ae63ULL
+#define HASH_PRIME5 0x27d4eb2f165667c5ULL
+
+static uint64_t hash_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * HASH_PRIME2;
+    return hash_rotl(acc, 31) * HASH_PRIME1;
+}
+
+static uint64_t data_hash(const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v[4] = {HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0,
+                         0 - HASH_PRIME1};
+        do {
+            for (int i = 0; i < 4; i++)
+                v[i] = hash_round(v[i], hash_read64(&data[i * 8]));
+            data += 32;
+        } while (end - data >= 32);
+        h = hash_rotl(v[0], 1) + hash_rotl(v[1], 7) + hash_rotl(v[2], 12) +
+            hash_rotl(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = (h ^ hash_round(0, v[i])) * HASH_PRIME1 + HASH_PRIME4;
+    } else {
+        h = HASH_PRIME5;
+    }
+    h += len;
+
+    for (; end - data >= 8; data += 8)
+        h = hash_rotl(h ^ hash_round(0, hash_read64(data)), 27) *
+                HASH_PRIME1 +
+            HASH_PRIME4;
+    if (end - data >= 4) {
+        uint32_t k;
+        memcpy(&k, data, sizeof(k));
+        h = hash_rotl(h ^ (k * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+        data += 4;
+    }
+    for (; data < end; data++)
+        h = hash_rotl(h ^ (*data * HASH_PRIME5), 11) * HASH_PRIME1;
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    return h ^ (h >> 32);
+}
+
+/* Whether the file at path holds exactly len bytes of data */
+static bool file_matches(const char *path, const uint8_t *data, size_t len)
+{
+    uint8_t buffer[4096];
+    size_t done = 0, n;
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp)
+        return false;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        if (n > len - done || memcmp(buffer, &data[done], n) != 0)
+            break;
+        done += n;
+    }
+    fclose(fp);
+    return n == 0 && done == len;
+}
+
+/* Whether image was loaded from exactly these len bytes */
+static bool image_matches(const struct pdf_object *image,
+                          const uint8_t *data, size_t len)
+{
+    const uint8_t *source = image->stream.source;
+
+    if (image->stream.source_len != len)
+        return false;
+    if (image->stream.path)
+        return file_matches(image->stream.path, data, len);
+    /* A JPEG in memory is its own source */
+    if (!source && !image->stream.raw)
+        source = image->stream.data;
+    return source && memcmp(source, data, len) == 0;
+}
+
+/*
+ * An image loaded before from the same data, so it can be shared.
+ * Every candidate is compared byte for byte: a JPEG against its data, in
+ * memory or in its file, and a converted format against the copy of the
+ * data it keeps for this. Once an image is written out by
+ * pdf_flush_pages that data is dropped, and only images loaded from a
+ * file can still be shared.
+ */
+static struct pdf_object *pdf_find_image(struct pdf_doc *pdf, uint64_t hash,
+                                         const uint8_t *data, size_t len)
+{
+    if (!pdf->image_buckets)
+        return NULL;
+    for (struct pdf_object *obj =
+             pdf->image_buckets[hash & (pdf->image_bucket_count - 1)];
+         obj; obj = obj->stream.hash_next) {
+        if (obj->stream.hash != hash || !image_matches(obj, data, len))
+            continue;
+        obj->stream.shares++;
+        return obj;
+    }
+    return NULL;
+}
+
+/*
+ * Records the data a new image was loaded from, so pdf_find_image can find
+ * it. A converted image takes over source, a malloc()ed copy of the data,
+ * and without one it is not shared. Neither is it without memory for a
+ * bigger table
+ */
+static void pdf_index_image(struct pdf_doc *pdf, struct pdf_object *image,
+                            uint64_t hash, uint8_t *source, size_t len)
+{
+    image->stream.hash = hash;
+    image->stream.source_len = len;
+    image->stream.source = source;
+    /* Nothing to compare later loads with */
+    if (!source && !image->stream.path &&
+        (image->stream.raw || !image->stream.data))
+        return;
+
+    if (pdf->image_count >= pdf->image_bucket_count) {
+        size_t count = pdf->image_bucket_count ? pdf->image_bucket_count * 2
+                                               : 64;
+        struct pdf_object **buckets =
+            (struct pdf_object **)calloc(count, sizeof(*buckets));
+
+        if (buckets) {
+            for (size_t i = 0; i < pdf->image_bucket_count; i++) {
+                struct pdf_object *obj = pdf->image_buckets[i], *next;
+                for (; obj; obj = next) {
+                    size_t b = obj->stream.hash & (count - 1);
+                    next = obj->stream.hash_next;
+                    obj->stream.hash_next = buckets[b];
+                    buckets[b] = obj;
+                }
+            }
+            free(pdf->image_buckets);
+            pdf->image_buckets = buckets;
+            pdf->image_bucket_count = count;
+        } else if (!pdf->image_buckets) {
+            return;
+        }
+    }
+
+    size_t b = hash & (pdf->image_bucket_count - 1);
+    image->stream.hash_next = pdf->image_buckets[b];
+    pdf->image_buckets[b] = image;
+    pdf->image_count++;
+}
+
+static void pdf_unindex_image(struct pdf_doc *pdf, struct pdf_object *image)
+{
+    struct pdf_object **link;
+
+    if (!pdf->image_buckets)
+        return;
+    link = &pdf->image_buckets[image->stream.hash &
+                               (pdf->image_bucket_count - 1)];
+    while (*link && *link != image)
+        link = &(*link)->stream.hash_next;
+    if (*link) {
+        *link = image->stream.hash_next;
+        pdf->image_count--;
+    }
+}
+
+static struct pdf_object *pdf_decode_image(struct pdf_doc *pdf,
+                                           const uint8_t *data, size_t len)
 {
+    struct pdf_object *image = NULL;
     struct pdf_img_info info = {
         .image_format = IMAGE_UNKNOWN,
         .width = 0,
@@ -4122,46 +7020,157 @@ int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
 
     int ret = pdf_parse_image_header(&info, data, len, pdf->errstr,
                                      sizeof(pdf->errstr));
-    if (ret)
-        return ret;
+    if (ret) {
+        pdf->errval = ret;
+        return NULL;
+    }
 
     // Try and determine which image format it is based on the content
     switch (info.image_format) {
     case IMAGE_PNG:
-        return pdf_add_png_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        return pdf_load_png_data(pdf, &info, data, len);
     case IMAGE_BMP:
-        return pdf_add_bmp_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        pdf_load_bmp_data(pdf, &info, data, len, &image);
+        return image;
     case IMAGE_JPG:
-        return pdf_add_jpeg_data(pdf, page, x, y, display_width,
-                                 display_height, &info, data, len);
+        return pdf_add_raw_jpeg_data(pdf, &info, data, len);
     case IMAGE_PPM:
-        return pdf_add_ppm_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        return pdf_load_ppm_data(pdf, &info, data, len);
 
     // This case should be caught in parse_image_header, but is checked
     // here again for safety
     case IMAGE_UNKNOWN:
     default:
-        return pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+        pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+        return NULL;
+    }
+}
+
+struct pdf_object *pdf_load_image_data(struct pdf_doc *pdf,
+                                       const uint8_t *data, size_t len)
+{
+    uint64_t hash = data_hash(data, len);
+    struct pdf_object *image = pdf_find_image(pdf, hash, data, len);
+
+    if (!image) {
+        image = pdf_decode_image(pdf, data, len);
+        if (image) {
+            uint8_t *source = NULL;
+            /* Converted images need a copy of the data to compare with */
+            if (image->stream.raw || !image->stream.data) {
+                source = (uint8_t *)malloc(len ? len : 1);
+                if (source)
+                    memcpy(source, data, len);
+            }
+            pdf_index_image(pdf, image, hash, source, len);
+        }
+    }
+    return image;
+}
+
+/*
+ * Loads a malloc()ed image, which is freed unless a JPEG keeps it as its
+ * payload. A JPEG read from path is read again from there when saved
+ */
+static struct pdf_object *pdf_load_image(struct pdf_doc *pdf, uint8_t *data,
+                                         size_t len, const char *path)
+{
+    uint64_t hash = data_hash(data, len);
+    struct pdf_object *image = pdf_find_image(pdf, hash, data, len);
+    struct pdf_img_info info = {
+        .image_format = IMAGE_UNKNOWN,
+        .width = 0,
+        .height = 0,
+        .jpeg = {0},
+    };
+
+    if (image) {
+        free(data);
+        return image;
+    }
+
+    int ret = pdf_parse_image_header(&info, data, len, pdf->errstr,
+                                     sizeof(pdf->errstr));
+    if (ret) {
+        pdf->errval = ret;
+    } else if (info.image_format == IMAGE_JPG && path) {
+        image = pdf_add_jpeg_object(pdf, &info, len);
+        if (image) {
+            image->stream.data_len = len;
+            image->stream.path = strdup(path);
+            if (!image->stream.path) {
+                pdf_del_object(pdf, image);
+                image = NULL;
+                pdf_set_err(pdf, -ENOMEM, "Unable to allocate filename");
+            }
+        }
+    } else if (info.image_format == IMAGE_JPG) {
+        image = pdf_add_raw_jpeg_buffer(pdf, &info, data, len);
+        if (image)
+            data = NULL; // Owned by the image now
+    } else {
+        // Every other format is converted, the data is kept to compare
+        // later loads with
+        image = pdf_decode_image(pdf, data, len);
+        if (image) {
+            pdf_index_image(pdf, image, hash, data, len);
+            return image;
+        }
     }
+
+    if (image)
+        pdf_index_image(pdf, image, hash, NULL, len);
+    free(data);
+    return image;
+}
+
+struct pdf_object *pdf_load_image_buffer(struct pdf_doc *pdf, uint8_t *data,
+                                         size_t len)
+{
+    return pdf_load_image(pdf, data, len, NULL);
+}
+
+struct pdf_object *pdf_load_image_file(struct pdf_doc *pdf,
+                                       const char *image_filename)
+{
+    size_t len;
+    uint8_t *data;
+
+    data = get_file(pdf, image_filename, &len);
+    if (data == NULL)
+        return NULL;
+
+    return pdf_load_image(pdf, data, len, image_filename);
+}
+
+int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                       float y, float display_width, float display_height,
+                       const uint8_t *data, size_t len)
+{
+    struct pdf_object *image = pdf_load_image_data(pdf, data, len);
+    if (!image)
+        return pdf->errval;
+
+    return pdf_place_image(pdf, page, image, x, y, display_width,
+                           display_height);
 }
 
 int pdf_add_image_file(struct pdf_doc *pdf, struct pdf_object *page, float x,
                        float y, float display_width, float display_height,
                        const char *image_filename)
 {
+    struct pdf_object *image;
     size_t len;
     uint8_t *data;
-    int ret = 0;
 
+    /* Read in full, so the file can go as soon as this returns */
     data = get_file(pdf, image_filename, &len);
     if (data == NULL)
         return pdf_get_errval(pdf);
+    image = pdf_load_image(pdf, data, len, NULL);
+    if (!image)
+        return pdf->errval;
 
-    ret = pdf_add_image_data(pdf, page, x, y, display_width, display_height,
-                             data, len);
-    free(data);
-    return ret;
+    return pdf_place_image(pdf, page, image, x, y, display_width,
+                           display_height);
 }
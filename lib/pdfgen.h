@@ -285,6 +285,16 @@ enum {
                         //!< no writes
 };
 
+/**
+ * Stream compression levels, see \ref pdf_set_compression
+ */
+enum {
+    PDF_COMPRESS_NONE = 0,    //!< Write streams uncompressed
+    PDF_COMPRESS_FAST = 1,    //!< Fastest compression
+    PDF_COMPRESS_DEFAULT = 6, //!< Good balance of speed and size
+    PDF_COMPRESS_BEST = 9,    //!< Smallest output, slowest
+};
+
 /**
  * Create a new PDF object, with the given page
  * width/height
@@ -394,6 +404,18 @@ struct pdf_object *pdf_append_page(struct pdf_doc *pdf);
  */
 struct pdf_object *pdf_get_page(struct pdf_doc *pdf, int page_number);
 
+/**
+ * Remove every page from the document, along with the page contents,
+ * links and bookmarks.
+ *
+ * Image objects are kept and can be placed again with \ref pdf_place_image,
+ * so a document can be laid out again without reloading its images.
+ *
+ * @param pdf PDF document to clear
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_clear_pages(struct pdf_doc *pdf);
+
 /**
  * Adjust the width/height of a specific page
  * @param pdf PDF document that the page belongs to
@@ -405,6 +427,35 @@ struct pdf_object *pdf_get_page(struct pdf_doc *pdf, int page_number);
 int pdf_page_set_size(struct pdf_doc *pdf, struct pdf_object *page,
                       float width, float height);
 
+/**
+ * Compress content streams and raw (BMP/PPM/RGB/grayscale) images with
+ * /FlateDecode when the document is saved.
+ * JPEG and PNG images are already compressed and are left alone. PNG images
+ * with an alpha channel are the exception: they are split into a colour
+ * image and a soft mask, which are compressed even at level 0.
+ * @param pdf PDF document to update
+ * @param level 0 for no compression (the default), 1 (fastest) to 9
+ * (smallest output), see PDF_COMPRESS_DEFAULT
+ * @param threads Number of threads compressing streams in parallel when
+ * several are written at once, 0 or 1 to use only the calling thread
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_set_compression(struct pdf_doc *pdf, int level, int threads);
+
+/**
+ * Save the document as PDF 1.5, with all objects other than content and
+ * image streams packed into compressed object streams, and a
+ * cross-reference stream in place of the xref table.
+ * This makes documents with many pages, bookmarks or links smaller, but
+ * needs a PDF 1.5 capable reader.
+ * Must be set before \ref pdf_save_begin.
+ * @param pdf PDF document to update
+ * @param enable Non-zero for object streams, 0 for a classic PDF 1.4 file
+ * (the default)
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_set_object_streams(struct pdf_doc *pdf, int enable);
+
 /**
  * Save the given pdf document to the supplied filename.
  * @param pdf PDF document to save
@@ -421,6 +472,66 @@ int pdf_save(struct pdf_doc *pdf, const char *filename);
  */
 int pdf_save_file(struct pdf_doc *pdf, FILE *fp);
 
+/**
+ * Output function for \ref pdf_save_callback.
+ * Called with the document in large blocks, in order.
+ * @param opaque Pointer given to \ref pdf_save_callback
+ * @param data Next part of the document
+ * @param len Number of bytes in data
+ * @return < 0 (ideally a negative errno value) to abort the save, >= 0 on
+ * success
+ */
+typedef int (*pdf_write_func)(void *opaque, const void *data, size_t len);
+
+/**
+ * Save the given pdf document through a caller supplied output function
+ * @param pdf PDF document to save
+ * @param write Function that receives the document data
+ * @param opaque Pointer passed through to write
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_save_callback(struct pdf_doc *pdf, pdf_write_func write,
+                      void *opaque);
+
+/**
+ * Save the given pdf document into memory
+ * @param pdf PDF document to save
+ * @param data Set to the malloc'ed document, which the caller must free
+ * @param len Set to the size of the document in bytes
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_save_memory(struct pdf_doc *pdf, uint8_t **data, size_t *len);
+
+/**
+ * Start saving the given pdf document to the supplied filename while it is
+ * still being built.
+ * Finished pages can then be written out early with \ref pdf_flush_pages,
+ * and \ref pdf_save_end writes the rest of the document.
+ * @param pdf PDF document to save
+ * @param filename Name of the file to store the PDF into
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_save_begin(struct pdf_doc *pdf, const char *filename);
+
+/**
+ * Write every page but the most recently added one to the file opened by
+ * \ref pdf_save_begin, together with their contents and images, and free the
+ * image and content data.
+ * Flushed pages can no longer be drawn on. Images placed on them can still
+ * be placed on later pages.
+ * @param pdf PDF document being saved
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_flush_pages(struct pdf_doc *pdf);
+
+/**
+ * Finish a save started with \ref pdf_save_begin: write all remaining
+ * objects, the xref table and the trailer, and close the file.
+ * @param pdf PDF document being saved
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_save_end(struct pdf_doc *pdf);
+
 /**
  * Add a text string to the document
  * @param pdf PDF document to add to
@@ -704,6 +815,7 @@ int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
 /**
  * Add image data as an image to the document.
  * Image data must be one of: JPEG, PNG, PPM, PGM or BMP formats
+ * Data identical to an image added before reuses that image.
  * Passing 0 for either the display width or height will
  * include the image but not render it visible.
  * Passing a negative number either the display height or width will
@@ -722,6 +834,83 @@ int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
                        float y, float display_width, float display_height,
                        const uint8_t *data, size_t len);
 
+/**
+ * Add image data to the document as an image object, without placing it on
+ * any page.
+ * Image data must be one of: JPEG, PNG, PPM, PGM or BMP formats.
+ * Loading data that is identical to an image loaded before returns that
+ * same image object, so the image is only stored once. Every load is
+ * released separately by \ref pdf_del_image. Data is compared byte for
+ * byte: other formats than JPEG are converted when loaded, so a copy of
+ * their data is kept for this until the image is written out by
+ * \ref pdf_flush_pages.
+ * @param pdf PDF document to add image to
+ * @param data Image data bytes
+ * @param len Length of data
+ * @return Image object, or NULL on failure
+ */
+struct pdf_object *pdf_load_image_data(struct pdf_doc *pdf,
+                                       const uint8_t *data, size_t len);
+
+/**
+ * Add image data to the document as an image object, like
+ * \ref pdf_load_image_data, but take ownership of the buffer.
+ * JPEG data is written out directly from the buffer, without being copied;
+ * it is freed when the document is destroyed. Other formats are converted
+ * and the buffer is kept to compare later loads with, see
+ * \ref pdf_load_image_data. It is freed on failure.
+ * @param pdf PDF document to add image to
+ * @param data malloc()ed image data bytes
+ * @param len Length of data
+ * @return Image object, or NULL on failure
+ */
+struct pdf_object *pdf_load_image_buffer(struct pdf_doc *pdf, uint8_t *data,
+                                         size_t len);
+
+/**
+ * Add an image file to the document as an image object, like
+ * \ref pdf_load_image_data.
+ * Of a JPEG file only the name and header are kept: its data is copied
+ * from the file when the document is saved, so the file must stay
+ * unchanged until then. Saving fails if its length has changed. Other
+ * formats are converted straight away. \ref pdf_add_image_file reads
+ * the whole file instead.
+ * @param pdf PDF document to add image to
+ * @param image_filename Filename of image file to load
+ * @return Image object, or NULL on failure
+ */
+struct pdf_object *pdf_load_image_file(struct pdf_doc *pdf,
+                                       const char *image_filename);
+
+/**
+ * Place an image object from \ref pdf_load_image_data on a page.
+ * An image can be placed any number of times, on any pages; it is stored
+ * in the document only once.
+ * Passing a negative number either the display height or width will
+ * have the image be resized while keeping the original aspect ratio.
+ * @param pdf PDF document the image belongs to
+ * @param page Page to add image to (NULL => most recently added page)
+ * @param image Image object to place
+ * @param x X offset to put image at
+ * @param y Y offset to put image at
+ * @param display_width Displayed width of image
+ * @param display_height Displayed height of image
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_place_image(struct pdf_doc *pdf, struct pdf_object *page,
+                    struct pdf_object *image, float x, float y,
+                    float display_width, float display_height);
+
+/**
+ * Release an image object loaded by \ref pdf_load_image_data or
+ * \ref pdf_load_image_buffer. The image is removed from the document when
+ * its last load is released, which fails while it is still on a page.
+ * @param pdf PDF document the image belongs to
+ * @param image Image object to remove
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_del_image(struct pdf_doc *pdf, struct pdf_object *image);
+
 /**
  * Add a raw 24 bit per pixel RGB buffer as an image to the document
  * Passing 0 for either the display width or height will
@@ -767,6 +956,7 @@ int pdf_add_grayscale8(struct pdf_doc *pdf, struct pdf_object *page, float x,
  * Passing a negative number either the display height or width will
  * have the image be resized while keeping the original aspect ratio.
  * Supports image formats: JPEG, PNG, PPM, PGM & BMP
+ * The file is read in full, so it can be removed once this returns.
  * @param pdf PDF document to add bookmark to
  * @param page Page to add image to (NULL => most recently added page)
  * @param x X offset to put image at
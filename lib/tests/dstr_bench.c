@@ -0,0 +1,62 @@
+/*
+ * Appends 4 KiB pieces to a dstr until it holds 64 MiB, and reports the
+ * cost per byte at every doubling of its length. Growing the buffer has
+ * to stay amortised constant time: the time per byte stays flat, and the
+ * bytes moved by reallocations stay below twice the bytes appended.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -o dstr_bench lib/tests/dstr_bench.c -lm -lpthread \
+ *       && ./dstr_bench
+ */
+#include "../pdfgen.c"
+
+#define PIECE_LEN 4096
+#define TOTAL_LEN ((size_t)64 << 20)
+
+int main(void)
+{
+    struct dstr str = INIT_DSTR;
+    char piece[PIECE_LEN];
+    size_t next_report = (size_t)1 << 20;
+    size_t moved = 0, resizes = 0;
+    clock_t start;
+    bool ok = true;
+
+    memset(piece, 'x', sizeof(piece));
+    printf("%10s %12s %10s %14s\n", "MiB", "ns/byte", "resizes",
+           "moved/appended");
+
+    start = clock();
+    while (dstr_len(&str) < TOTAL_LEN) {
+        size_t alloc_len = str.alloc_len, used_len = dstr_len(&str);
+
+        if (dstr_append_data(&str, piece, sizeof(piece)) < 0) {
+            printf("FAIL: out of memory at %zu bytes\n", used_len);
+            dstr_free(&str);
+            return 1;
+        }
+        /* A resize has to carry over what the string held so far */
+        if (str.alloc_len != alloc_len) {
+            moved += used_len;
+            resizes++;
+        }
+
+        if (dstr_len(&str) == next_report) {
+            double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9;
+            double ratio = (double)moved / dstr_len(&str);
+
+            printf("%10zu %12.3f %10zu %14.2f\n", next_report >> 20,
+                   ns / dstr_len(&str), resizes, ratio);
+            if (ratio > 2)
+                ok = false;
+            next_report *= 2;
+        }
+    }
+    dstr_free(&str);
+
+    if (!ok) {
+        printf("FAIL: appending copies the string more than it grows\n");
+        return 1;
+    }
+    return 0;
+}
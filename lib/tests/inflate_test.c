@@ -0,0 +1,90 @@
+/*
+ * Regression tests for the inflater used by PNG images with alpha.
+ * Damaged input has to be rejected without reading past its end.
+ *
+ * Build and run from the repository root:
+ *   gcc -fsanitize=address,undefined -o inflate_test \
+ *       lib/tests/inflate_test.c -lm -lpthread && ./inflate_test
+ */
+#include "../pdfgen.c"
+
+static int failures;
+
+static void check(bool ok, const char *what, size_t len)
+{
+    if (!ok) {
+        printf("FAIL: %s (%zu bytes)\n", what, len);
+        failures++;
+    }
+}
+
+/* Every prefix of in must be rejected, without reading beyond it */
+static void check_truncations(const uint8_t *in, size_t len, size_t out_len,
+                              const char *what)
+{
+    uint8_t *out = (uint8_t *)malloc(out_len + 1);
+
+    for (size_t l = 0; l < len; l++) {
+        /* An exactly sized copy, so reading past it is caught */
+        uint8_t *copy = (uint8_t *)malloc(l ? l : 1);
+        memcpy(copy, in, l);
+        check(pdf_inflate(copy, l, out, out_len) < 0, what, l);
+        free(copy);
+    }
+    free(out);
+}
+
+static void test_stored_block(void)
+{
+    /* A final stored block of 1000 bytes, with only 3 of them present */
+    const uint8_t truncated[] = {0x78, 0x01, 0x01, 0xe8, 0x03,
+                                 0x17, 0xfc, 'a',  'b',  'c'};
+    /* The same block with its three bytes, complete */
+    const uint8_t stored[] = {0x78, 0x01, 0x01, 0x03, 0x00, 0xfc, 0xff,
+                              'a',  'b',  'c',  0x02, 0x4d, 0x01, 0x27};
+    uint8_t out[1000];
+
+    check(pdf_inflate(truncated, sizeof(truncated), out, sizeof(out)) < 0,
+          "truncated stored block", sizeof(truncated));
+    check_truncations(truncated, sizeof(truncated), sizeof(out),
+                      "truncated stored block prefix");
+
+    check(pdf_inflate(stored, sizeof(stored), out, 3) == 0 &&
+              memcmp(out, "abc", 3) == 0,
+          "stored block", sizeof(stored));
+    check_truncations(stored, sizeof(stored), 3, "stored block prefix");
+}
+
+static void test_compressed_stream(void)
+{
+    const size_t len = 20000;
+    uint8_t *data = (uint8_t *)malloc(len);
+    uint8_t *out = (uint8_t *)malloc(len);
+    uint8_t *packed;
+    ssize_t packed_len;
+
+    for (size_t i = 0; i < len; i++)
+        data[i] = (uint8_t)((i * 7) % 251 ^ (i / 100));
+    packed_len = pdf_deflate(data, len, PDF_COMPRESS_DEFAULT, &packed);
+    check(packed_len > 0, "deflate", len);
+    if (packed_len > 0) {
+        check(pdf_inflate(packed, packed_len, out, len) == 0 &&
+                  memcmp(out, data, len) == 0,
+              "compressed stream", (size_t)packed_len);
+        check_truncations(packed, packed_len, len,
+                          "truncated compressed stream");
+        free(packed);
+    }
+    free(data);
+    free(out);
+}
+
+int main(void)
+{
+    test_stored_block();
+    test_compressed_stream();
+    if (failures)
+        return 1;
+    printf("inflate tests passed\n");
+    return 0;
+}
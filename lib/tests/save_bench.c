@@ -0,0 +1,103 @@
+/*
+ * Times loading, placing and saving documents of 10k, 50k and 100k
+ * images, one per page. Every image is a distinct PPM loaded through
+ * pdf_load_image_buffer, as video2pdf loads its frames, so a lookup or
+ * save step that scans all images shows up as a per-image cost that
+ * grows with the document.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -o save_bench lib/tests/save_bench.c -lm -lpthread \
+ *       && ./save_bench
+ */
+#include "../pdfgen.c"
+
+#define FRAME_SIZE 4
+
+/* A FRAME_SIZE x FRAME_SIZE PPM whose pixels encode n */
+static uint8_t *frame_ppm(int n, size_t *len)
+{
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+                              FRAME_SIZE, FRAME_SIZE);
+    size_t pixels_len = FRAME_SIZE * FRAME_SIZE * 3;
+    uint8_t *data = (uint8_t *)malloc(header_len + pixels_len);
+
+    if (!data)
+        return NULL;
+    memcpy(data, header, header_len);
+    for (size_t i = 0; i < pixels_len; i++)
+        data[header_len + i] = (uint8_t)(n >> (8 * (i % 3)));
+    *len = header_len + pixels_len;
+    return data;
+}
+
+static double seconds_since(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Per-image microseconds to build and to save a document of count images,
+ * or a negative value on failure */
+static int bench(int count, double *build_us, double *save_us)
+{
+    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    clock_t start;
+    int e = 0;
+
+    if (!pdf)
+        return -ENOMEM;
+
+    start = clock();
+    for (int i = 0; i < count && e >= 0; i++) {
+        struct pdf_object *image;
+        size_t len;
+        uint8_t *data = frame_ppm(i, &len);
+
+        if (!data || !pdf_append_page(pdf)) {
+            free(data);
+            e = -ENOMEM;
+            break;
+        }
+        image = pdf_load_image_buffer(pdf, data, len);
+        e = image ? pdf_place_image(pdf, NULL, image, 50, 50, 200, -1)
+                  : pdf_get_errval(pdf);
+    }
+    *build_us = seconds_since(start) * 1e6 / count;
+
+    if (e >= 0) {
+        start = clock();
+        e = pdf_save_memory(pdf, &out, &out_len);
+        *save_us = seconds_since(start) * 1e6 / count;
+    }
+    if (e < 0)
+        printf("%d images: %s\n", count, pdf_get_err(pdf, NULL));
+
+    free(out);
+    pdf_destroy(pdf);
+    return e;
+}
+
+int main(void)
+{
+    const int counts[] = {10000, 50000, 100000};
+    const int runs = sizeof(counts) / sizeof(counts[0]);
+    double build_us[3], save_us[3];
+
+    printf("%8s %16s %16s\n", "images", "build us/image", "save us/image");
+    for (int i = 0; i < runs; i++) {
+        if (bench(counts[i], &build_us[i], &save_us[i]) < 0)
+            return 1;
+        printf("%8d %16.2f %16.2f\n", counts[i], build_us[i], save_us[i]);
+    }
+
+    /* Linear work keeps the per-image cost flat. A scan of all images
+     * per image makes it ten times higher at 100k than at 10k */
+    if (build_us[runs - 1] > 3 * build_us[0] ||
+        save_us[runs - 1] > 3 * save_us[0]) {
+        printf("FAIL: per-image cost grows with the document\n");
+        return 1;
+    }
+    return 0;
+}
@@ -5,18 +5,47 @@
 #include <string.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "lib/pdfgen.h"
 
+#ifdef HAVE_LIBAV
+#  include <libavformat/avformat.h>
+#  include <libavcodec/avcodec.h>
+#  include <libswscale/swscale.h>
+#endif
+
 /// Globals
 
 #define MAX_TIMESTAMPS 100 // adjust if needed
+#define MAX_JOBS 64
+#define MAX_QUEUE_DEPTH MAX_TIMESTAMPS
 
 #ifdef _WIN32
-#  include <direct.h>   // _getcwd
+#  include <direct.h>   // _getcwd, _mkdir
+#  include <io.h>       // _unlink
+#  include <process.h>  // _getpid
+#  include <sys/utime.h>
 #  define getcwd _getcwd
+#  define getpid _getpid
+#  define MKDIR(path) _mkdir(path)
+#  define RMDIR(path) _rmdir(path)
+#  define UNLINK(path) _unlink(path)
+#  define POPEN_READ_BINARY "rb"
 #  define PATH_SEP '\\'
 #else
-#  include <unistd.h>   // getcwd
+#  include <unistd.h>   // getcwd, getpid
+#  include <utime.h>
+#  define MKDIR(path) mkdir(path, 0755)
+#  define RMDIR(path) rmdir(path)
+#  define UNLINK(path) unlink(path)
+#  define POPEN_READ_BINARY "r"
 #  define PATH_SEP '/'
 #endif
 
@@ -29,10 +58,16 @@
 
 char *videofile = NULL;
 int timestamps[MAX_TIMESTAMPS];
+double frame_times[MAX_TIMESTAMPS];  // seek positions, see resolve_frame_times()
+bool frame_is_key[MAX_TIMESTAMPS];
+unsigned char *cached_frames[MAX_TIMESTAMPS]; // hits from the frame cache
+size_t cached_sizes[MAX_TIMESTAMPS];
+struct pdf_object *frame_images[MAX_TIMESTAMPS]; // embedded image per timestamp
+bool keep_session = false; // interactive mode reuses the document between runs
 int timestamp_count = 0;
 char outfilename[MAX_PATH_LEN];
 char outputfile[MAX_PATH_LEN];
-char imgfile[MAX_PATH_LEN];
+char workdir[MAX_PATH_LEN]; // private temp directory of this run
 
 char *typeface = "Times-Roman";
 int font_size = 12;
@@ -44,269 +79,2270 @@ int top_margin = 0;
 int top_crop = 0;
 int bottom_crop = 0;
 int start_y_pos = 455; // magic number
+bool single_pass = false;
+int jobs = 1;
+int queue_depth = 8; // frames extracted ahead of the PDF assembly, 0 = off
+bool use_libav = false;
+bool snap_keyframes = false;
+double snap_tolerance = 2.0;
+int cache_size_mb = 512;
+int compress_level = PDF_COMPRESS_NONE; // Flate level of the page contents, off by default
+bool object_streams = false; // PDF 1.5 object and xref streams
+
+static struct option long_options[] = {
+    {"input", required_argument, 0, 'i'},
+    {"output", required_argument, 0, 'o'},
+    {"timestamps", required_argument, 0, 't'},
+    {"margins", optional_argument, 0, 'm'},
+    {"top_margin", optional_argument, 0, 'u'},
+    {"single-pass", no_argument, 0, 's'},
+    {"jobs", required_argument, 0, 'J'},
+    {"backend", required_argument, 0, 'b'},
+    {"snap", required_argument, 0, 'S'},
+    {"cache-size", required_argument, 0, 'C'},
+    {"queue-depth", required_argument, 0, 'Q'},
+    {"compress", required_argument, 0, 'z'},
+    {"object-streams", no_argument, 0, 'O'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+/// Forward declarations
+
+struct video_info;
+const char *cache_dir(void);
+int probe_video(const char *filename, struct video_info *info);
+void video_abspath(const char *filename, char *abspath, size_t size);
+const struct video_info *get_video_info(const char *filename);
+void video_display_size(const struct video_info *info, int *width, int *height);
+bool get_jpeg_dim(BYTE_ARRAY data, size_t data_size, int *width, int *height);
+unsigned char* read_file(const char* filename, size_t* filesize);
+const double *get_keyframe_index(const char *filename, int *count);
+int resolve_frame_times(void);
+char *format_seconds(char *buf, size_t size, double seconds);
+int frame_cache_fetch(void);
+void frame_cache_release(void);
+void frame_cache_store(double seconds, const unsigned char *data, size_t len);
+void frame_cache_trim(void);
+int screenshot_command(char *command, size_t size, double seconds, bool keyframe,
+                       const char *outfile);
+int make_workdir(void);
+void remove_workdir(void);
+void frame_imgfile(char *path, size_t size, int i);
+void take_screenshot(double seconds, bool keyframe, const char *outfile);
+int parse_timestamp(const char *str);
+void set_output_path(const char *videopath, const char *outfilename);
+struct page_layout;
+int place_image(struct page_layout *layout, struct pdf_object *image);
+int place_frame(struct page_layout *layout, unsigned char *data, size_t len);
+bool frame_ready(int i);
+int place_ready_frame(struct page_layout *layout, int i);
+long jpeg_frame_length(const unsigned char *data, size_t len);
+int extract_frames_pipe(struct page_layout *layout, int video_width, int video_height,
+                        int jobs);
+int extract_frames_parallel(struct page_layout *layout, int jobs);
+int extract_frames_pipelined(struct page_layout *layout, int jobs, int depth);
+#ifdef HAVE_LIBAV
+int extract_frames_libav(struct page_layout *layout, const struct video_info *video);
+#endif
+struct pdf_doc *session_begin(void);
+void session_end(struct pdf_doc *pdf, bool keep);
+void session_close(void);
+int create_pdf();
+char *format_timestamp(int seconds);
+void open_outputfile(void);
+void download_video(const char *url);
+void prompt_help(void);
+void prompt_for_input(void);
+void help(void);
+
+/// Video metadata
+
+struct video_info {
+    int width;
+    int height;
+    double duration;      // seconds
+    int frame_rate_num;   // r_frame_rate as num/den
+    int frame_rate_den;
+    char codec[32];
+    int rotation;         // degrees, 0/90/180/270
+    int stream_index;
+};
+
+// Identity of the probed file, used as the cache key
+struct video_key {
+    long long size;
+    long long mtime;
+};
+
+static struct video_info probed_info;
+static struct video_key probed_key;
+static char probed_path[MAX_PATH_LEN];
+static bool probed_valid = false;
+
+/// parse_decimal
+
+// ffprobe always prints '.' as decimal separator, regardless of our locale
+static double parse_decimal(const char *str) {
+    double value = 0.0, scale = 1.0;
+    bool negative = false;
+
+    if (*str == '-') {
+        negative = true;
+        str++;
+    }
+    while (isdigit((unsigned char)*str)) {
+        value = value * 10 + (*str++ - '0');
+    }
+    if (*str == '.') {
+        str++;
+        while (isdigit((unsigned char)*str)) {
+            scale /= 10;
+            value += (*str++ - '0') * scale;
+        }
+    }
+    return negative ? -value : value;
+}
+
+/// cache_dir
+
+const char *cache_dir(void) {
+    static char dir[MAX_PATH_LEN + 16]; // room for "/video2pdf" after the parent
+
+    if (dir[0]) {
+        return dir;
+    }
+
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+    if (!base) {
+        base = ".";
+    }
+    snprintf(dir, sizeof(dir), "%s\\video2pdf", base);
+#else
+    char parent[MAX_PATH_LEN];
+    const char *base = getenv("XDG_CACHE_HOME");
+    if (base && base[0]) {
+        snprintf(parent, sizeof(parent), "%s", base);
+    }
+    else {
+        const char *home = getenv("HOME");
+        snprintf(parent, sizeof(parent), "%s/.cache", home ? home : "/tmp");
+    }
+    MKDIR(parent);
+    snprintf(dir, sizeof(dir), "%s/video2pdf", parent);
+#endif
+
+    MKDIR(dir);
+    return dir;
+}
+
+/// get_video_key
+
+static int get_video_key(const char *filename, struct video_key *key) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return -1;
+    }
+    key->size = (long long)st.st_size;
+    key->mtime = (long long)st.st_mtime;
+    return 0;
+}
+
+/// probe_video
+
+int probe_video(const char *filename, struct video_info *info) {
+    char command[MAX_PATH_LEN + 256];
+    snprintf(command, sizeof(command),
+             "ffprobe -v error -select_streams v:0 "
+             "-show_entries stream=index,codec_name,width,height,r_frame_rate"
+             ":stream_tags=rotate:stream_side_data=rotation:format=duration "
+             "-of default=noprint_wrappers=1 \"%s\"", filename);
+
+    FILE *fp = popen(command, "r");
+    if (!fp) {
+        perror("popen failed");
+        return -1;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->frame_rate_den = 1;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *value = strchr(line, '=');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(line, "index") == 0) {
+            info->stream_index = atoi(value);
+        }
+        else if (strcmp(line, "codec_name") == 0) {
+            snprintf(info->codec, sizeof(info->codec), "%s", value);
+        }
+        else if (strcmp(line, "width") == 0) {
+            info->width = atoi(value);
+        }
+        else if (strcmp(line, "height") == 0) {
+            info->height = atoi(value);
+        }
+        else if (strcmp(line, "r_frame_rate") == 0) {
+            if (sscanf(value, "%d/%d", &info->frame_rate_num, &info->frame_rate_den) != 2
+                || info->frame_rate_den == 0) {
+                info->frame_rate_num = 0;
+                info->frame_rate_den = 1;
+            }
+        }
+        else if (strcmp(line, "TAG:rotate") == 0) {
+            info->rotation = atoi(value);
+        }
+        else if (strcmp(line, "rotation") == 0) {
+            // Display matrix rotation is counter-clockwise, the tag clockwise
+            info->rotation = -atoi(value);
+        }
+        else if (strcmp(line, "duration") == 0) {
+            info->duration = parse_decimal(value);
+        }
+    }
+    pclose(fp);
+
+    info->rotation = ((info->rotation % 360) + 360) % 360;
+
+    if (info->width <= 0 || info->height <= 0) {
+        fprintf(stderr, "ffprobe found no video stream in %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/// probe cache
+
+// False when the path does not fit, and the cache cannot be used
+static bool probe_cache_path(char *path, size_t size) {
+    int len = snprintf(path, size, "%s%cprobe.cache", cache_dir(), PATH_SEP);
+    return len >= 0 && (size_t)len < size;
+}
+
+// Cache lines: size mtime width height duration_us fps_num fps_den
+//              rotation stream_index codec path
+// Returns the offset of the path in line, or 0 for a malformed line
+static int probe_cache_parse(char *line, struct video_key *key,
+                             struct video_info *info) {
+    long long duration_us;
+    int offset = 0;
+
+    memset(info, 0, sizeof(*info));
+    line[strcspn(line, "\r\n")] = '\0';
+    if (sscanf(line, "%lld %lld %d %d %lld %d %d %d %d %31s %n",
+               &key->size, &key->mtime, &info->width, &info->height,
+               &duration_us, &info->frame_rate_num, &info->frame_rate_den,
+               &info->rotation, &info->stream_index, info->codec,
+               &offset) != 10 || offset == 0 || line[offset] == '\0') {
+        return 0;
+    }
+    info->duration = duration_us / 1e6;
+    if (strcmp(info->codec, "-") == 0) {
+        info->codec[0] = '\0';
+    }
+    return offset;
+}
+
+static void probe_cache_write(FILE *fp, const char *filename,
+                              const struct video_key *key,
+                              const struct video_info *info) {
+    fprintf(fp, "%lld %lld %d %d %lld %d %d %d %d %s %s\n",
+            key->size, key->mtime, info->width, info->height,
+            (long long)(info->duration * 1e6), info->frame_rate_num,
+            info->frame_rate_den, info->rotation, info->stream_index,
+            info->codec[0] ? info->codec : "-", filename);
+}
+
+static bool probe_cache_lookup(const char *filename, const struct video_key *key,
+                               struct video_info *info) {
+    char path[MAX_PATH_LEN];
+    if (!probe_cache_path(path, sizeof(path))) {
+        return false;
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+
+    bool found = false;
+    char line[MAX_PATH_LEN + 256];
+    while (!found && fgets(line, sizeof(line), fp)) {
+        struct video_key entry_key;
+        struct video_info entry;
+        int offset = probe_cache_parse(line, &entry_key, &entry);
+
+        if (offset && entry_key.size == key->size &&
+            entry_key.mtime == key->mtime &&
+            strcmp(line + offset, filename) == 0) {
+            *info = entry;
+            found = true;
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+// Rewrites the cache with the new entry in place of any older one for the same
+// file. Entries of videos that are gone or have changed since are dropped too,
+// so the cache only ever holds one line per video on disk. Like the frame
+// cache, it goes through a private temp file that is renamed into place.
+static void probe_cache_store(const char *filename, const struct video_key *key,
+                              const struct video_info *info) {
+    char path[MAX_PATH_LEN];
+    char tmp[MAX_PATH_LEN + 32];
+    if (!probe_cache_path(path, sizeof(path))) {
+        return;
+    }
+    int len = snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        return;
+    }
+
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        return;
+    }
+
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[MAX_PATH_LEN + 256];
+        while (fgets(line, sizeof(line), in)) {
+            struct video_key entry_key, current;
+            struct video_info entry;
+            int offset = probe_cache_parse(line, &entry_key, &entry);
+
+            if (!offset || strcmp(line + offset, filename) == 0 ||
+                get_video_key(line + offset, &current) != 0 ||
+                current.size != entry_key.size ||
+                current.mtime != entry_key.mtime) {
+                continue;
+            }
+            probe_cache_write(out, line + offset, &entry_key, &entry);
+        }
+        fclose(in);
+    }
+    probe_cache_write(out, filename, key, info);
+
+    if (fclose(out) != 0) {
+        remove(tmp);
+        return;
+    }
+#ifdef _WIN32
+    remove(path); // rename() does not replace an existing file here
+#endif
+    if (rename(tmp, path) != 0) {
+        remove(tmp);
+    }
+}
+
+/// video_abspath
+
+// Relative paths are ambiguous in a shared cache
+void video_abspath(const char *filename, char *abspath, size_t size) {
+#ifdef _WIN32
+    if (!_fullpath(abspath, filename, size)) {
+#else
+    (void)size; // realpath() needs PATH_MAX bytes, which MAX_PATH_LEN is
+    if (!realpath(filename, abspath)) {
+#endif
+        snprintf(abspath, size, "%s", filename);
+    }
+}
+
+/// get_video_info
+
+// Probes each input at most once: first the in-memory copy, then the on-disk
+// cache, and only then ffprobe
+const struct video_info *get_video_info(const char *filename) {
+    struct video_key key;
+
+    if (get_video_key(filename, &key) != 0) {
+        fprintf(stderr, "Cannot access %s\n", filename);
+        return NULL;
+    }
+
+    if (probed_valid && strcmp(probed_path, filename) == 0 &&
+        probed_key.size == key.size && probed_key.mtime == key.mtime) {
+        return &probed_info;
+    }
+
+    char abspath[MAX_PATH_LEN];
+    video_abspath(filename, abspath, sizeof(abspath));
+
+    probed_valid = false;
+    if (!probe_cache_lookup(abspath, &key, &probed_info)) {
+        if (probe_video(filename, &probed_info) != 0) {
+            return NULL;
+        }
+        probe_cache_store(abspath, &key, &probed_info);
+    }
+
+    snprintf(probed_path, sizeof(probed_path), "%s", filename);
+    probed_key = key;
+    probed_valid = true;
+    return &probed_info;
+}
+
+/// video_display_size
+
+// ffmpeg autorotates before any filter runs, so crops apply to the rotated frame
+void video_display_size(const struct video_info *info, int *width, int *height) {
+    if (info->rotation == 90 || info->rotation == 270) {
+        *width = info->height;
+        *height = info->width;
+    }
+    else {
+        *width = info->width;
+        *height = info->height;
+    }
+}
+
+/// get_jpeg_dim
+
+bool get_jpeg_dim(BYTE_ARRAY data, size_t data_size, int *width, int *height) {
+	*width = *height = -1;
+	size_t off = 0;
+
+	while (off < data_size) {
+		while(data[off] == 0xff) {
+			off++;
+		}
+
+		int mrkr = data[off];  off++;
+
+		if (mrkr == 0xd8) continue;    // SOI
+		if (mrkr == 0xd9) break;       // EOI
+		if (0xd0 <= mrkr && mrkr <= 0xd7) continue;
+		if (mrkr == 0x01) continue;    // TEM
+
+		const int len = (data[off]<<8) | data[off+1];  off += 2;
+
+		if (mrkr == 0xc0) {
+			*height = (data[off+1]<<8) | data[off+2];
+			*width = (data[off+3]<<8) | data[off+4];
+			return true;
+		}
+		off += len - 2;
+	}
+	return false;
+}
+
+/// read_file
+
+unsigned char* read_file(const char* filename, size_t* filesize) {
+	FILE* f = fopen(filename, "rb");
+	if (!f) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*filesize = ftell(f);
+	rewind(f);
+
+	unsigned char* buffer = malloc(*filesize);
+	if (!buffer) {
+		fclose(f);
+		return NULL;
+	}
+
+	if (fread(buffer, 1, *filesize, f) != *filesize) {
+		free(buffer);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	return buffer;
+}
+
+/// fnv1a
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// Keyframe index
+
+static double *keyframe_times = NULL;
+static int keyframe_count = 0;
+static struct video_key keyframe_key;
+static char keyframe_path[MAX_PATH_LEN];
+
+/// keyframe_cache_path
+
+// One index file per video, next to probe.cache, named by a hash of the key
+static void keyframe_cache_path(char *path, size_t size, const char *abspath,
+                                const struct video_key *key) {
+    uint64_t hash = fnv1a(14695981039346656037ULL, abspath, strlen(abspath));
+    hash = fnv1a(hash, key, sizeof(*key));
+
+    snprintf(path, size, "%s%ckeyframes-%016llx.cache", cache_dir(), PATH_SEP,
+             (unsigned long long)hash);
+}
+
+/// add_time
+
+static int add_time(double **times, int *count, int *capacity, double seconds) {
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 256;
+        double *grown = realloc(*times, new_capacity * sizeof(double));
+        if (!grown) {
+            return -1;
+        }
+        *times = grown;
+        *capacity = new_capacity;
+    }
+    (*times)[(*count)++] = seconds;
+    return 0;
+}
+
+/// list_frame_times
+
+// Fills *times with the sorted presentation times of the frames of the first
+// video stream, or of its keyframes only, up to `end` seconds (all when
+// negative). Only the container is read, nothing is decoded.
+static int list_frame_times(const char *filename, bool keys_only, double end,
+                            double **times, int *count) {
+    char command[MAX_PATH_LEN + 256];
+    char position[32];
+    snprintf(command, sizeof(command),
+             "ffprobe -v error -select_streams v:0 %s%s%s"
+             "-show_entries packet=pts_time,flags -of csv=p=0 \"%s\"",
+             end < 0 ? "" : "-read_intervals %+",
+             end < 0 ? "" : format_seconds(position, sizeof(position), end),
+             end < 0 ? "" : " ", filename);
+
+    FILE *fp = popen(command, "r");
+    if (!fp) {
+        perror("popen failed");
+        return -1;
+    }
+
+    int capacity = 0;
+    char line[128];
+    *count = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        char *flags = strchr(line, ',');
+        if (!flags || (keys_only && flags[1] != 'K') ||
+            !isdigit((unsigned char)line[0])) {
+            continue;
+        }
+        if (add_time(times, count, &capacity, parse_decimal(line)) != 0) {
+            break;
+        }
+    }
+    pclose(fp);
+
+    // Packets come in decode order, which may differ from presentation order
+    double *t = *times;
+    for (int i = 1; i < *count; i++) {
+        double seconds = t[i];
+        int j = i;
+        while (j > 0 && t[j - 1] > seconds) {
+            t[j] = t[j - 1];
+            j--;
+        }
+        t[j] = seconds;
+    }
+
+    return *count > 0 ? 0 : -1;
+}
+
+/// keyframe_cache_store
+
+// Like the other caches, the index goes through a private temp file that is
+// renamed into place, so a concurrent run or a failed write never leaves a
+// truncated index behind for the next run to trust
+static void keyframe_cache_store(const char *path) {
+    char tmp[MAX_PATH_LEN + 96];
+    int len = snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        return;
+    }
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        return;
+    }
+    bool written = true;
+    for (int i = 0; i < keyframe_count && written; i++) {
+        written = fprintf(fp, "%lld\n", (long long)(keyframe_times[i] * 1e6)) > 0;
+    }
+    if (fclose(fp) != 0 || !written) {
+        remove(tmp);
+        return;
+    }
+#ifdef _WIN32
+    remove(path); // rename() does not replace an existing file here
+#endif
+    if (rename(tmp, path) != 0) {
+        remove(tmp);
+    }
+}
+
+/// get_keyframe_index
+
+// Returns the sorted keyframe times of the video, building the index at most
+// once per video. The on-disk copy stores whole microseconds.
+const double *get_keyframe_index(const char *filename, int *count) {
+    struct video_key key;
+    char abspath[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN + 64];
+
+    if (get_video_key(filename, &key) != 0) {
+        return NULL;
+    }
+    video_abspath(filename, abspath, sizeof(abspath));
+
+    if (keyframe_count > 0 && strcmp(keyframe_path, abspath) == 0 &&
+        keyframe_key.size == key.size && keyframe_key.mtime == key.mtime) {
+        *count = keyframe_count;
+        return keyframe_times;
+    }
+
+    keyframe_count = 0;
+    keyframe_cache_path(path, sizeof(path), abspath, &key);
+
+    int capacity = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        long long us;
+        while (fscanf(fp, "%lld", &us) == 1) {
+            if (add_time(&keyframe_times, &keyframe_count, &capacity,
+                         us / 1e6) != 0) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+
+    if (keyframe_count == 0) {
+        printf("Indexing keyframes...\n");
+        if (list_frame_times(filename, true, -1, &keyframe_times,
+                             &keyframe_count) != 0) {
+            fprintf(stderr, "Found no keyframes in %s\n", filename);
+            return NULL;
+        }
+        keyframe_cache_store(path);
+    }
+
+    snprintf(keyframe_path, sizeof(keyframe_path), "%s", abspath);
+    keyframe_key = key;
+    *count = keyframe_count;
+    return keyframe_times;
+}
+
+/// resolve_frame_times
+
+// Fills frame_times[] from timestamps[]. With --snap keyframe each time moves
+// to the nearest keyframe within the tolerance, which is then the only frame
+// that needs decoding.
+int resolve_frame_times(void) {
+    const double *keys = NULL;
+    int count = 0;
+
+    if (snap_keyframes) {
+        keys = get_keyframe_index(videofile, &count);
+        if (!keys) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < timestamp_count; i++) {
+        double t = timestamps[i];
+        frame_times[i] = t;
+        frame_is_key[i] = false;
+
+        if (!keys) {
+            continue;
+        }
+
+        // First keyframe at or after t, then pick the closer neighbour
+        int lo = 0, hi = count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (keys[mid] < t) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        int best = -1;
+        if (lo < count) {
+            best = lo;
+        }
+        if (lo > 0 && (best < 0 || t - keys[lo - 1] <= keys[best] - t)) {
+            best = lo - 1;
+        }
+
+        if (best >= 0 && fabs(keys[best] - t) <= snap_tolerance) {
+            frame_times[i] = keys[best];
+            frame_is_key[i] = true;
+        }
+    }
+    return 0;
+}
+
+/// format_seconds
+
+// Locale-independent seconds for ffmpeg arguments, rounded down to whole
+// microseconds so that a snapped seek never lands after its keyframe
+char *format_seconds(char *buf, size_t size, double seconds) {
+    long long us = (long long)floor(seconds * 1e6);
+    snprintf(buf, size, "%lld.%06lld", us / 1000000, us % 1000000);
+    return buf;
+}
+
+/// Frame cache
+
+// Extracted frames are kept in <cache dir>/frames, named by a hash of the
+// video identity, the time, the crop and the extraction settings. Reads touch
+// the file, so the modification time orders the cache for LRU eviction.
+static uint64_t frame_cache_base;
+static bool frame_cache_ready = false;
+
+/// frame_settings_hash
+
+// Hashes the video identity and everything but the time that changes an
+// extracted JPEG. Returns 0 when the video cannot be found.
+static uint64_t frame_settings_hash(void) {
+    struct video_key key;
+    char abspath[MAX_PATH_LEN];
+
+    if (get_video_key(videofile, &key) != 0) {
+        return 0;
+    }
+    video_abspath(videofile, abspath, sizeof(abspath));
+
+    int settings[] = {top_crop, bottom_crop, use_libav, 1 /* -q:v */};
+    uint64_t hash = fnv1a(14695981039346656037ULL, abspath, strlen(abspath));
+    hash = fnv1a(hash, &key, sizeof(key));
+    return fnv1a(hash, settings, sizeof(settings));
+}
+
+/// frame_cache_path
+
+static void frame_cache_path(char *path, size_t size, double seconds) {
+    long long us = (long long)floor(seconds * 1e6);
+    uint64_t hash = fnv1a(frame_cache_base, &us, sizeof(us));
+    snprintf(path, size, "%s%cframes%c%016llx.jpg", cache_dir(), PATH_SEP,
+             PATH_SEP, (unsigned long long)hash);
+}
+
+/// frame_cache_fetch
+
+// Loads every cached frame of the current job into cached_frames[]. Returns
+// the number of hits.
+int frame_cache_fetch(void) {
+    char path[MAX_PATH_LEN + 64];
+    int hits = 0;
+
+    memset(cached_frames, 0, sizeof(cached_frames));
+    frame_cache_ready = false;
+    if (cache_size_mb <= 0 || (frame_cache_base = frame_settings_hash()) == 0) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s%cframes", cache_dir(), PATH_SEP);
+    MKDIR(path);
+    frame_cache_ready = true;
+
+    for (int i = 0; i < timestamp_count; i++) {
+        if (frame_images[i]) {
+            continue; // still in the interactive session's document
+        }
+        frame_cache_path(path, sizeof(path), frame_times[i]);
+        cached_frames[i] = read_file(path, &cached_sizes[i]);
+        if (cached_frames[i]) {
+            utime(path, NULL);
+            hits++;
+        }
+    }
+    return hits;
+}
+
+/// frame_cache_release
+
+void frame_cache_release(void) {
+    for (int i = 0; i < timestamp_count; i++) {
+        free(cached_frames[i]);
+        cached_frames[i] = NULL;
+    }
+}
+
+/// frame_cache_store
+
+// Writes to a private temp name first and renames it into place, so other
+// runs sharing the cache never see a partial frame
+void frame_cache_store(double seconds, const unsigned char *data, size_t len) {
+    static int counter = 0;
+    char path[MAX_PATH_LEN + 64];
+    char tmp[MAX_PATH_LEN + 96];
+
+    if (!frame_cache_ready) {
+        return;
+    }
+    frame_cache_path(path, sizeof(path), seconds);
+    snprintf(tmp, sizeof(tmp), "%s.%d-%d.tmp", path, (int)getpid(), counter++);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        return;
+    }
+    bool written = fwrite(data, 1, len, fp) == len;
+    if (fclose(fp) != 0 || !written || rename(tmp, path) != 0) {
+        remove(tmp);
+    }
+}
+
+/// frame_cache_trim
+
+struct cache_entry {
+    long long mtime;
+    long long size;
+    char name[64];
+};
+
+static int compare_cache_entries(const void *a, const void *b) {
+    const struct cache_entry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Evicts the least recently used frames until the cache fits its size cap.
+// Leftover temp files from crashed runs go after an hour.
+void frame_cache_trim(void) {
+    char dir[MAX_PATH_LEN + 16];
+    char path[MAX_PATH_LEN + 96];
+
+    if (!frame_cache_ready) {
+        return;
+    }
+    int dir_len = snprintf(dir, sizeof(dir), "%s%cframes", cache_dir(), PATH_SEP);
+    if (dir_len < 0 || (size_t)dir_len >= sizeof(dir)) {
+        return;
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct cache_entry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *ent;
+
+    while ((ent = readdir(d)) != NULL) {
+        struct stat st;
+        size_t name_len = strlen(ent->d_name);
+        if (ent->d_name[0] == '.' || name_len >= sizeof(entries->name)) {
+            continue;
+        }
+        int len = snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP,
+                           ent->d_name);
+        if (len < 0 || (size_t)len >= sizeof(path) || stat(path, &st) != 0) {
+            continue;
+        }
+        if (name_len > 4 && strcmp(ent->d_name + name_len - 4, ".tmp") == 0) {
+            if (now - st.st_mtime > 3600) {
+                remove(path);
+            }
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct cache_entry *grown = realloc(entries, capacity * sizeof(*entries));
+            if (!grown) {
+                break;
+            }
+            entries = grown;
+        }
+        entries[count].mtime = (long long)st.st_mtime;
+        entries[count].size = (long long)st.st_size;
+        memcpy(entries[count].name, ent->d_name, name_len + 1); // fits, see above
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    long long limit = (long long)cache_size_mb * 1024 * 1024;
+    if (total > limit) {
+        qsort(entries, count, sizeof(*entries), compare_cache_entries);
+        for (size_t i = 0; i < count && total > limit; i++) {
+            snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP, entries[i].name);
+            if (remove(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+}
+
+/// screenshot_command
+
+// Builds the ffmpeg command that writes the (cropped) frame at the given
+// time to outfile. For a keyframe the decoder skips every other frame.
+int screenshot_command(char *command, size_t size, double seconds, bool keyframe,
+                       const char *outfile) {
+    int video_width, video_height;
+    char position[32];
+
+    const struct video_info *info = get_video_info(videofile);
+    if (!info) {
+        printf("get_video_info() failed for %s\n", videofile);
+        return -1;
+    }
+    video_display_size(info, &video_width, &video_height);
+
+    snprintf(command, size,
+             "ffmpeg -y -loglevel error %s-ss %s -i \"%s\" -frames:v 1 -q:v 1 -vf \"crop=%d:%d:%d:%d\" \"%s\"",
+             keyframe ? "-skip_frame nokey " : "",
+             format_seconds(position, sizeof(position), seconds),
+             videofile,
+             video_width,                            // width
+             video_height - top_crop - bottom_crop,  // height after cropping
+             0,                                      // x offset
+             top_crop,                               // y offset
+             outfile);
+    return 0;
+}
+
+/// Workspace
+
+// Every run extracts into its own directory, so any number of conversions can
+// share a machine. It is removed on every way out: normal exit, error exit and
+// the usual termination signals.
+
+/// remove_workdir
+
+void remove_workdir(void) {
+    char path[MAX_PATH_LEN + 256];
+
+    if (workdir[0] == '\0') {
+        return;
+    }
+
+    DIR *d = opendir(workdir);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            snprintf(path, sizeof(path), "%s%c%s", workdir, PATH_SEP, ent->d_name);
+            remove(path);
+        }
+        closedir(d);
+    }
+    RMDIR(workdir);
+    workdir[0] = '\0';
+}
+
+// Every file a run can leave in the workdir, named before the signal handlers
+// are installed. The handler may interrupt malloc or stdio in any thread, so
+// it must not format names or walk the directory itself.
+static char workdir_files[MAX_TIMESTAMPS][MAX_PATH_LEN + 32];
+
+static void remove_workdir_on_signal(int sig) {
+    // Only async-signal-safe calls from here on
+    for (int i = 0; i < MAX_TIMESTAMPS; i++) {
+        UNLINK(workdir_files[i]);
+    }
+    RMDIR(workdir);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/// make_workdir
+
+int make_workdir(void) {
+#ifdef _WIN32
+    const char *tempdir = getenv("TEMP");
+    if (!tempdir) {
+        tempdir = "."; // Om TEMP inte är satt, använd aktuell katalog
+    }
+    snprintf(workdir, sizeof(workdir), "%s\\vip-XXXXXX", tempdir);
+    if (_mktemp_s(workdir, strlen(workdir) + 1) != 0 || MKDIR(workdir) != 0) {
+        workdir[0] = '\0';
+    }
+#else
+    const char *tempdir = getenv("TMPDIR");
+    if (!tempdir) {
+        tempdir = "/tmp";
+    }
+    snprintf(workdir, sizeof(workdir), "%s/vip-XXXXXX", tempdir);
+    if (!mkdtemp(workdir)) {
+        workdir[0] = '\0';
+    }
+#endif
+    if (workdir[0] == '\0') {
+        perror("Cannot create temporary directory");
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_TIMESTAMPS; i++) {
+        frame_imgfile(workdir_files[i], sizeof(workdir_files[i]), i);
+    }
+    atexit(remove_workdir);
+    signal(SIGINT, remove_workdir_on_signal);
+    signal(SIGTERM, remove_workdir_on_signal);
+#ifndef _WIN32
+    signal(SIGHUP, remove_workdir_on_signal);
+#endif
+    return 0;
+}
+
+/// frame_imgfile
+
+// Frame i is extracted to <workdir>/frame-<i>.jpg
+void frame_imgfile(char *path, size_t size, int i) {
+    snprintf(path, size, "%s%cframe-%d.jpg", workdir, PATH_SEP, i);
+}
+
+/// take_screenshot
+
+void take_screenshot(double seconds, bool keyframe, const char *outfile) {
+    char command[2 * MAX_PATH_LEN + 256];
+
+    if (screenshot_command(command, sizeof(command), seconds, keyframe, outfile) != 0) {
+        return;
+    }
+
+    int return_code = system(command);
+
+    if (return_code != 0) {
+        printf("Command execution failed or returned "
+               "non-zero: %d", return_code);
+    }
+}
+
+/// parse_timestamp
+
+int parse_timestamp(const char *str) {
+    int minutes, seconds;
+    if (sscanf(str, "%d:%d", &minutes, &seconds) != 2) {
+        fprintf(stderr, "Ogiltigt tidsformat: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+    return minutes * 60 + seconds;
+}
+
+/// set_output_path
+
+void set_output_path(const char *videopath, const char *outfilename) {
+    const char *last_sep = strrchr(videopath, '/');
+#ifdef _WIN32
+    if (!last_sep) {
+        last_sep = strrchr(videopath, '\\');  // Windows-separator
+    }
+#endif
+
+    if (!last_sep) {
+        // Ingen separator – använd nuvarande arbetskatalog
+        if (!getcwd(outputfile, MAX_PATH_LEN)) {
+            perror("getcwd failed");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t len = strlen(outputfile);
+        if (len + 1 >= MAX_PATH_LEN) {
+            fprintf(stderr, "Sökvägen är för lång\n");
+            exit(EXIT_FAILURE);
+        }
+
+        outputfile[len] = '/';
+        outputfile[len + 1] = '\0';
+
+        strncat(outputfile, outfilename, MAX_PATH_LEN - strlen(outputfile) - 1);
+        return;
+    }
+
+    // Hämta katalogdelen av sökvägen
+    size_t dirlen = last_sep - videopath + 1;
+    if (dirlen >= MAX_PATH_LEN) {
+        fprintf(stderr, "Sökvägen är för lång\n");
+        exit(EXIT_FAILURE);
+    }
+
+    strncpy(outputfile, videopath, dirlen);
+    outputfile[dirlen] = '\0';
+
+    strncat(outputfile, outfilename, MAX_PATH_LEN - dirlen - 1);
+}
+
+/// Page layout
+
+struct page_layout {
+    struct pdf_doc *pdf;
+    int display_width;
+    int scaled_height;
+    int this_y_pos;
+    int pagenr;
+    int placed;
+    bool streaming; // finished pages go to the output file right away
+};
+
+/// place_image
+
+// Places the next frame below the previous one, starting a new page when it
+// does not fit
+int place_image(struct page_layout *layout, struct pdf_object *image) {
+    struct pdf_doc *pdf = layout->pdf;
+
+    if (layout->placed == 0 || layout->this_y_pos - layout->scaled_height < 0) {
+        pdf_append_page(pdf);
+        layout->this_y_pos = start_y_pos - top_margin;
+        layout->pagenr++;
+
+        // Only the page being filled has to stay in memory
+        if (layout->streaming && pdf_flush_pages(pdf) < 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", outputfile,
+                    pdf_get_err(pdf, NULL));
+            return -1;
+        }
+    }
+    else {
+        layout->this_y_pos -= layout->scaled_height;
+    }
+
+    int added = pdf_place_image(pdf, NULL, image,
+                                margins,
+                                layout->this_y_pos + margins + bottom_crop,
+                                layout->display_width,
+                                -1);
+    if (added < 0) {
+        fprintf(stderr, "Failed to add frame: %s\n", pdf_get_err(pdf, NULL));
+        return -1;
+    }
+    frame_images[layout->placed++] = image;
+
+    char page_str[20];
+    sprintf(page_str, "%d", layout->pagenr);
+    float text_width;
+    pdf_get_font_text_width(pdf, typeface, page_str, font_size, &text_width);
+    int x = (PDF_A4_WIDTH - text_width) / 2;
+    pdf_add_text(pdf, NULL, page_str, font_size, x, 15, PDF_BLACK);
+
+    return 0;
+}
+
+/// place_frame
+
+// Embeds a malloc()ed JPEG and places it. The document takes the buffer over
+// and writes it out as is, so a frame is never copied on its way into the PDF.
+int place_frame(struct page_layout *layout, unsigned char *data, size_t len) {
+    struct pdf_object *image = pdf_load_image_buffer(layout->pdf, data, len);
+    if (!image) {
+        fprintf(stderr, "Failed to add frame: %s\n", pdf_get_err(layout->pdf, NULL));
+        return -1;
+    }
+    return place_image(layout, image);
+}
+
+/// frame_ready
+
+// True when frame i needs no extraction: it is still embedded from the
+// previous interactive run or it was found in the frame cache
+bool frame_ready(int i) {
+    return frame_images[i] != NULL || cached_frames[i] != NULL;
+}
+
+/// place_ready_frame
+
+int place_ready_frame(struct page_layout *layout, int i) {
+    if (frame_images[i]) {
+        return place_image(layout, frame_images[i]);
+    }
+    unsigned char *data = cached_frames[i];
+    cached_frames[i] = NULL;
+    return place_frame(layout, data, cached_sizes[i]);
+}
+
+/// jpeg_frame_length
+
+// Length of the complete JPEG at the start of data, 0 if more data is needed
+// and -1 if data does not start with a JPEG. Walks the marker segments so
+// that bytes inside headers or entropy-coded data are never taken for EOI.
+long jpeg_frame_length(const unsigned char *data, size_t len) {
+    if (len < 2) {
+        return 0;
+    }
+    if (data[0] != 0xff || data[1] != 0xd8) {
+        return -1;
+    }
+
+    size_t off = 2;
+    while (off + 2 <= len) {
+        if (data[off] != 0xff) {
+            return -1;
+        }
+
+        int mrkr = data[off + 1];
+        if (mrkr == 0xff) {                             // fill byte
+            off++;
+            continue;
+        }
+        if (mrkr == 0xd9) {                             // EOI
+            return (long)(off + 2);
+        }
+        if (mrkr == 0x01 || (0xd0 <= mrkr && mrkr <= 0xd7)) {
+            off += 2;
+            continue;
+        }
+
+        if (off + 4 > len) {
+            return 0;
+        }
+        off += 2 + ((data[off + 2] << 8) | data[off + 3]);
+
+        if (mrkr == 0xda) {                             // SOS
+            // Entropy-coded data runs until a marker other than a stuffed
+            // 0xff00 or a restart marker
+            while (off + 1 < len) {
+                if (data[off] == 0xff && data[off + 1] != 0x00 &&
+                    !(0xd0 <= data[off + 1] && data[off + 1] <= 0xd7)) {
+                    break;
+                }
+                off++;
+            }
+        }
+    }
+    return 0;
+}
+
+/// place_pipe_frames
+
+// Places every timestamp from *next on whose frame is cached or has arrived
+// from ffmpeg, in input order
+static int place_pipe_frames(struct page_layout *layout, int *next,
+                             const double *sorted, int received,
+                             unsigned char **frames, const size_t *frame_sizes,
+                             int *uses) {
+    for (; *next < timestamp_count; (*next)++) {
+        int i = *next;
+        if (frame_ready(i)) {
+            if (place_ready_frame(layout, i) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        int k = 0;
+        while (sorted[k] != frame_times[i]) {
+            k++;
+        }
+        if (k >= received) {
+            break;
+        }
+        // The document takes the frame over; a time used twice needs a copy
+        unsigned char *data = frames[k];
+        if (--uses[k] == 0) {
+            frames[k] = NULL;
+        }
+        else if ((data = malloc(frame_sizes[k])) != NULL) {
+            memcpy(data, frames[k], frame_sizes[k]);
+        }
+        int result = data ? place_frame(layout, data, frame_sizes[k]) : -1;
+        if (result != 0) {
+            (*next)++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// keep_pipe_frames
+
+// Times that land on the same decoded frame (sparse or variable frame rate
+// video, or times less than a frame apart) select it only once, so ffmpeg
+// returns fewer frames than times and cannot say which is which. Every time
+// selects the first frame at or after it, so the frame times listed by the
+// container tell which frame belongs to which time. Those frames become ready
+// frames, and the number of times still without one is returned. When the
+// container disagrees with ffmpeg none of the frames are kept.
+static int keep_pipe_frames(const double *sorted, int sorted_count, bool all_key,
+                            unsigned char **frames, const size_t *frame_sizes,
+                            int received) {
+    int frame_of[MAX_TIMESTAMPS]; // index into frames[], -1 for none
+    double *times = NULL;
+    int count = 0;
+
+    if (list_frame_times(videofile, all_key, sorted[sorted_count - 1] + 1,
+                         &times, &count) != 0) {
+        free(times);
+        return sorted_count;
+    }
+
+    int distinct = 0;
+    int missing = 0;
+    for (int k = 0, j = 0, last = -1; k < sorted_count; k++) {
+        // Both sides have whole microseconds
+        while (j < count && times[j] < sorted[k] - 0.5e-6) {
+            j++;
+        }
+        if (j == count) {
+            frame_of[k] = -1;
+            missing++;
+            continue;
+        }
+        if (j != last) {
+            distinct++;
+            last = j;
+        }
+        frame_of[k] = distinct - 1;
+    }
+    free(times);
+    if (distinct != received) {
+        return sorted_count;
+    }
+
+    for (int k = 0; k < sorted_count; k++) {
+        if (frame_of[k] >= 0) {
+            frame_cache_store(sorted[k], frames[frame_of[k]], frame_sizes[frame_of[k]]);
+        }
+    }
+    for (int i = 0; i < timestamp_count; i++) {
+        if (frame_ready(i)) {
+            continue;
+        }
+        int k = 0;
+        while (sorted[k] != frame_times[i]) {
+            k++;
+        }
+        int f = frame_of[k];
+        if (f >= 0 && (cached_frames[i] = malloc(frame_sizes[f])) != NULL) {
+            memcpy(cached_frames[i], frames[f], frame_sizes[f]);
+            cached_sizes[i] = frame_sizes[f];
+        }
+    }
+    return missing;
+}
+
+/// extract_frames_pipe
+
+// Extracts every timestamp with a single ffmpeg process that streams MJPEG
+// frames over a pipe, and places them in timestamp order once all have arrived
+int extract_frames_pipe(struct page_layout *layout, int video_width, int video_height,
+                        int jobs) {
+    // ffmpeg emits the frames in presentation order, once per distinct time
+    double sorted[MAX_TIMESTAMPS];
+    int uses[MAX_TIMESTAMPS] = {0};
+    int sorted_count = 0;
+    bool all_key = true;
+
+    for (int i = 0; i < timestamp_count; i++) {
+        if (frame_ready(i)) {
+            continue;
+        }
+        int k = 0;
+        while (k < sorted_count && sorted[k] < frame_times[i]) {
+            k++;
+        }
+        if (k == sorted_count || sorted[k] != frame_times[i]) {
+            memmove(&sorted[k + 1], &sorted[k], (sorted_count - k) * sizeof(double));
+            memmove(&uses[k + 1], &uses[k], (sorted_count - k) * sizeof(int));
+            sorted[k] = frame_times[i];
+            uses[k] = 0;
+            sorted_count++;
+        }
+        uses[k]++;
+        all_key = all_key && frame_is_key[i];
+    }
+
+    unsigned char *frames[MAX_TIMESTAMPS] = {0};
+    size_t frame_sizes[MAX_TIMESTAMPS] = {0};
+    int received = 0;
+    int next = 0; // next timestamp index to place
+
+    if (sorted_count == 0) {
+        return place_pipe_frames(layout, &next, sorted, received, frames,
+                                 frame_sizes, uses);
+    }
+
+    size_t command_size = 512 + strlen(videofile) + sorted_count * 96;
+    char *command = malloc(command_size);
+    if (!command) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    // Select the first frame at or after each timestamp. When every time is a
+    // snapped keyframe, nothing else needs to be decoded at all.
+    char position[32];
+    int len = snprintf(command, command_size,
+                       "ffmpeg -loglevel error %s-i \"%s\" -an -fps_mode passthrough "
+                       "-vf \"trim=end=%s,select='",
+                       all_key ? "-skip_frame nokey " : "", videofile,
+                       format_seconds(position, sizeof(position),
+                                      sorted[sorted_count - 1] + 1));
+    for (int k = 0; k < sorted_count; k++) {
+        format_seconds(position, sizeof(position), sorted[k]);
+        len += snprintf(command + len, command_size - len,
+                        "%sgte(t,%s)*not(gte(prev_t,%s))",
+                        k ? "+" : "", position, position);
+    }
+    snprintf(command + len, command_size - len,
+             "',crop=%d:%d:%d:%d\" -frames:v %d -q:v 1 -f image2pipe -c:v mjpeg -",
+             video_width, video_height - top_crop - bottom_crop, 0, top_crop,
+             sorted_count);
+
+    FILE *fp = popen(command, POPEN_READ_BINARY);
+    free(command);
+    if (!fp) {
+        perror("popen failed");
+        return -1;
+    }
+
+    int result = 0;
+
+    size_t buf_len = 0, buf_size = 1 << 20;
+    unsigned char *buf = malloc(buf_size);
+
+    while (buf && result == 0) {
+        if (buf_len == buf_size) {
+            unsigned char *grown = realloc(buf, buf_size * 2);
+            if (!grown) {
+                break;
+            }
+            buf = grown;
+            buf_size *= 2;
+        }
+
+        size_t n = fread(buf + buf_len, 1, buf_size - buf_len, fp);
+        if (n == 0) {
+            break;
+        }
+        buf_len += n;
+
+        // Split off every complete frame in the buffer
+        long frame_len;
+        while (received < sorted_count &&
+               (frame_len = jpeg_frame_length(buf, buf_len)) != 0) {
+            if (frame_len < 0) {
+                fprintf(stderr, "Unexpected data from ffmpeg\n");
+                result = -1;
+                break;
+            }
+
+            frames[received] = malloc(frame_len);
+            if (!frames[received]) {
+                result = -1;
+                break;
+            }
+            memcpy(frames[received], buf, frame_len);
+            frame_sizes[received] = frame_len;
+            received++;
+            memmove(buf, buf + frame_len, buf_len - frame_len);
+            buf_len -= frame_len;
+        }
+    }
+
+    free(buf);
+    pclose(fp);
+
+    // Fewer frames than times means some frames were matched to the wrong
+    // time, so they are only used once they are sorted out. The times left
+    // over are extracted on their own, like the non-pipe paths do.
+    if (result == 0 && received < sorted_count) {
+        int missing = keep_pipe_frames(sorted, sorted_count, all_key, frames,
+                                       frame_sizes, received);
+        if (missing > 0) {
+            printf("ffmpeg returned %d of %d frames, extracting %d one by one\n",
+                   received, sorted_count, missing);
+        }
+        for (int k = 0; k < received; k++) {
+            free(frames[k]);
+        }
+        return extract_frames_parallel(layout, jobs);
+    }
+    if (result == 0) {
+        for (int k = 0; k < received; k++) {
+            frame_cache_store(sorted[k], frames[k], frame_sizes[k]);
+        }
+        result = place_pipe_frames(layout, &next, sorted, received, frames,
+                                   frame_sizes, uses);
+    }
+
+    for (int k = 0; k < sorted_count; k++) {
+        free(frames[k]);
+    }
+
+    if (result == 0 && next < timestamp_count) {
+        char *ts = format_timestamp(timestamps[next]);
+        fprintf(stderr, "ffmpeg returned no frame for %s\n", ts ? ts : "?");
+        free(ts);
+        result = -1;
+    }
+    return result;
+}
+
+/// frame_sink
+
+// Receives extracted frame i and takes ownership of its data. A nonzero
+// return stops the extraction.
+typedef int (*frame_sink)(void *ctx, int i, unsigned char *data, size_t len);
+
+/// extract_frames_workers
+
+// Runs up to `jobs` ffmpeg processes at once for every frame in wanted[]. The
+// frames are handed to the sink strictly in timestamp order, so the layout is
+// identical to the serial path.
+static int extract_frames_workers(int jobs, const bool *wanted,
+                                  frame_sink sink, void *ctx) {
+    FILE *workers[MAX_JOBS] = {0};
+    int frame[MAX_JOBS];       // timestamp index each slot is extracting
+    char command[2 * MAX_PATH_LEN + 256];
+    char path[MAX_PATH_LEN + 32];
+    int started = 0;
+    int finished = 0;
+    int next = 0;
+    int result = 0;
+
+    while (true) {
+        // Keep every slot busy
+        while (result == 0 && started - finished < jobs) {
+            while (next < timestamp_count && !wanted[next]) {
+                next++;
+            }
+            if (next == timestamp_count) {
+                break;
+            }
+
+            int slot = started % jobs;
+            frame_imgfile(path, sizeof(path), next);
+            if (screenshot_command(command, sizeof(command), frame_times[next],
+                                   frame_is_key[next], path) != 0) {
+                result = -1;
+                break;
+            }
+            workers[slot] = popen(command, "r");
+            if (!workers[slot]) {
+                perror("popen failed");
+                result = -1;
+                break;
+            }
+            frame[slot] = next++;
+            started++;
+        }
+
+        if (finished == started) {
+            break;
+        }
+
+        // Wait for the oldest outstanding frame
+        int slot = finished % jobs;
+        int return_code = pclose(workers[slot]);
+        workers[slot] = NULL;
+        finished++;
+
+        frame_imgfile(path, sizeof(path), frame[slot]);
+        if (result != 0) {
+            remove(path);
+            continue;
+        }
+        if (return_code != 0) {
+            printf("Command execution failed or returned "
+                   "non-zero: %d\n", return_code);
+        }
+
+        size_t filesize = 0;
+        unsigned char *jpeg_data = read_file(path, &filesize);
+        remove(path);
+        if (!jpeg_data) {
+            fprintf(stderr, "Failed to read file.\n");
+            result = -1;
+            continue;
+        }
+        frame_cache_store(frame_times[frame[slot]], jpeg_data, filesize);
+        result = sink(ctx, frame[slot], jpeg_data, filesize);
+    }
+
+    return result;
+}
+
+/// wanted_frames
+
+// Marks the frames that have to be extracted. Returns how many there are.
+static int wanted_frames(bool *wanted) {
+    int count = 0;
+    for (int i = 0; i < timestamp_count; i++) {
+        wanted[i] = !frame_ready(i);
+        count += wanted[i];
+    }
+    return count;
+}
+
+/// extract_frames_parallel
+
+struct ordered_placer {
+    struct page_layout *layout;
+    int next; // next timestamp index to place
+};
+
+// Places frame i after every ready frame in front of it
+static int place_in_order(void *ctx, int i, unsigned char *data, size_t len) {
+    struct ordered_placer *placer = ctx;
+    int result = 0;
+
+    while (result == 0 && placer->next < i) {
+        result = place_ready_frame(placer->layout, placer->next++);
+    }
+    if (result != 0) {
+        free(data);
+        return result;
+    }
+    placer->next++;
+    return place_frame(placer->layout, data, len);
+}
+
+int extract_frames_parallel(struct page_layout *layout, int jobs) {
+    bool wanted[MAX_TIMESTAMPS];
+    struct ordered_placer placer = {layout, 0};
+
+    wanted_frames(wanted);
+    int result = extract_frames_workers(jobs, wanted, place_in_order, &placer);
+    while (result == 0 && placer.next < timestamp_count) {
+        result = place_ready_frame(layout, placer.next++);
+    }
+    return result;
+}
+
+/// Frame queue
+
+// Bounded single-producer, single-consumer ring between the extraction thread
+// and the thread building the PDF. Only the producer moves head and only the
+// consumer moves tail, so passing a frame takes no lock. A side that finds the
+// ring full or empty sleeps on a condition variable; the lock is only taken
+// to sleep and to wake a side that is asleep.
+struct frame_slot {
+    int index;           // timestamp index, -1 marks the end of the stream
+    unsigned char *data;
+    size_t len;
+};
+
+struct frame_queue {
+    struct frame_slot *slots;
+    int depth;
+    atomic_int head;     // slots produced
+    atomic_int tail;     // slots consumed
+    atomic_bool cancel;  // the consumer has given up
+    atomic_bool producer_waiting;
+    atomic_bool consumer_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+};
+
+// Wakes the other side if it is asleep. It sets its flag under the lock
+// before it looks at the ring a last time, so either it sees the move made
+// before this call or this call sees the flag and signals once it sleeps.
+static void queue_wake(struct frame_queue *q, atomic_bool *waiting,
+                       pthread_cond_t *cond) {
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+// Blocks while the ring is full. Fails once the consumer has cancelled.
+static int queue_push(struct frame_queue *q, struct frame_slot slot) {
+    int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (head - atomic_load(&q->tail) == q->depth) {
+        pthread_mutex_lock(&q->lock);
+        atomic_store(&q->producer_waiting, true);
+        while (head - atomic_load(&q->tail) == q->depth &&
+               !atomic_load(&q->cancel)) {
+            pthread_cond_wait(&q->not_full, &q->lock);
+        }
+        atomic_store(&q->producer_waiting, false);
+        pthread_mutex_unlock(&q->lock);
+        if (atomic_load(&q->cancel)) {
+            return -1;
+        }
+    }
+    q->slots[head % q->depth] = slot;
+    atomic_store(&q->head, head + 1);
+    queue_wake(q, &q->consumer_waiting, &q->not_empty);
+    return 0;
+}
+
+// Blocks while the ring is empty
+static struct frame_slot queue_pop(struct frame_queue *q) {
+    int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (atomic_load(&q->head) == tail) {
+        pthread_mutex_lock(&q->lock);
+        atomic_store(&q->consumer_waiting, true);
+        while (atomic_load(&q->head) == tail) {
+            pthread_cond_wait(&q->not_empty, &q->lock);
+        }
+        atomic_store(&q->consumer_waiting, false);
+        pthread_mutex_unlock(&q->lock);
+    }
+    struct frame_slot slot = q->slots[tail % q->depth];
+    atomic_store(&q->tail, tail + 1);
+    queue_wake(q, &q->producer_waiting, &q->not_full);
+    return slot;
+}
+
+// Wakes a producer waiting for room and makes it give up
+static void queue_cancel(struct frame_queue *q) {
+    atomic_store(&q->cancel, true);
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_destroy(struct frame_queue *q) {
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    pthread_mutex_destroy(&q->lock);
+    free(q->slots);
+}
+
+static int queue_sink(void *ctx, int i, unsigned char *data, size_t len) {
+    struct frame_slot slot = {i, data, len};
+    if (queue_push(ctx, slot) != 0) {
+        free(data);
+        return -1;
+    }
+    return 0;
+}
+
+/// extract_frames_pipelined
+
+struct frame_producer {
+    struct frame_queue *queue;
+    const bool *wanted;
+    int jobs;
+};
+
+static void *produce_frames(void *arg) {
+    struct frame_producer *producer = arg;
+    struct frame_slot end = {-1, NULL, 0};
+
+    extract_frames_workers(producer->jobs, producer->wanted, queue_sink,
+                           producer->queue);
+    queue_push(producer->queue, end);
+    return NULL;
+}
+
+// Extracts on a separate thread that runs up to `depth` frames ahead of the
+// thread embedding them, so ffmpeg never waits for the PDF assembly
+int extract_frames_pipelined(struct page_layout *layout, int jobs, int depth) {
+    bool wanted[MAX_TIMESTAMPS];
+    struct frame_queue queue = {.depth = depth};
+    struct frame_producer producer = {&queue, wanted, jobs};
+    pthread_t thread;
+    int result = 0;
+
+    if (wanted_frames(wanted) == 0) {
+        for (int i = 0; i < timestamp_count && result == 0; i++) {
+            result = place_ready_frame(layout, i);
+        }
+        return result;
+    }
+
+    queue.slots = malloc(depth * sizeof(*queue.slots));
+    if (!queue.slots) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    atomic_init(&queue.head, 0);
+    atomic_init(&queue.tail, 0);
+    atomic_init(&queue.cancel, false);
+    atomic_init(&queue.producer_waiting, false);
+    atomic_init(&queue.consumer_waiting, false);
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_full, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+    if (pthread_create(&thread, NULL, produce_frames, &producer) != 0) {
+        fprintf(stderr, "Failed to start extraction thread\n");
+        queue_destroy(&queue);
+        return -1;
+    }
+
+    for (int i = 0; i < timestamp_count && result == 0; i++) {
+        if (!wanted[i]) {
+            result = place_ready_frame(layout, i);
+            continue;
+        }
+
+        struct frame_slot slot = queue_pop(&queue);
+        if (slot.index != i) {
+            result = -1; // extraction failed, the producer already said why
+            break;
+        }
+        result = place_frame(layout, slot.data, slot.len);
+    }
 
-static struct option long_options[] = {
-    {"input", required_argument, 0, 'i'},
-    {"output", required_argument, 0, 'o'},
-    {"timestamps", required_argument, 0, 't'},
-    {"margins", optional_argument, 0, 'm'},
-    {"top_margin", optional_argument, 0, 'u'},
-    {"help", no_argument, 0, 'h'},
-    {0, 0, 0, 0}
+    // Let a producer that is still running stop at its next frame, then
+    // release whatever it left in the ring
+    queue_cancel(&queue);
+    pthread_join(thread, NULL);
+    while (atomic_load(&queue.tail) != atomic_load(&queue.head)) {
+        struct frame_slot slot = queue_pop(&queue);
+        free(slot.data);
+    }
+    queue_destroy(&queue);
+    return result;
+}
+
+/// libav backend
+
+#ifdef HAVE_LIBAV
+
+// Decodes frames in-process: the container and decoder are opened once per
+// run, and each timestamp costs a seek, a decode and a JPEG encode in memory
+struct libav_decoder {
+    AVFormatContext *fmt;
+    AVCodecContext *dec;
+    AVCodecContext *enc;
+    struct SwsContext *sws;
+    AVFrame *frame;
+    AVFrame *yuv;
+    AVPacket *pkt;
+    int stream;
+    int64_t next_pts;
 };
 
-/// Forward declarations
+static void libav_close(struct libav_decoder *d) {
+    sws_freeContext(d->sws);
+    av_frame_free(&d->yuv);
+    av_frame_free(&d->frame);
+    av_packet_free(&d->pkt);
+    avcodec_free_context(&d->enc);
+    avcodec_free_context(&d->dec);
+    avformat_close_input(&d->fmt);
+}
 
-int get_video_dimensions(const char *filename, int *width, int *height);
-bool get_jpeg_dim(BYTE_ARRAY data, size_t data_size, int *width, int *height);
-unsigned char* read_file(const char* filename, size_t* filesize);
-void take_screenshot(int seconds);
-int parse_timestamp(const char *str);
-void set_output_path(const char *videopath, const char *outfilename);
-int create_pdf();
-char *format_timestamp(int seconds);
-void open_outputfile(void);
-void download_video(const char *url);
-void prompt_help(void);
-void prompt_for_input(void);
-void help(void);
+static int libav_open(struct libav_decoder *d, const char *filename,
+                      int width, int height) {
+    memset(d, 0, sizeof(*d));
 
-/// get_video_dimensions
+    if (avformat_open_input(&d->fmt, filename, NULL, NULL) < 0) {
+        fprintf(stderr, "libav: cannot open %s\n", filename);
+        return -1;
+    }
+    if (avformat_find_stream_info(d->fmt, NULL) < 0) {
+        fprintf(stderr, "libav: no stream info in %s\n", filename);
+        libav_close(d);
+        return -1;
+    }
 
-int get_video_dimensions(const char *filename, int *width, int *height) {
-    char command[512];
-    snprintf(command, sizeof(command),
-             "ffprobe -v error -select_streams v:0 -show_entries stream=width,height "
-             "-of csv=p=0:s=x \"%s\"", filename);
+    const AVCodec *decoder = NULL;
+    d->stream = av_find_best_stream(d->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    if (d->stream < 0 || !decoder) {
+        fprintf(stderr, "libav: no video stream in %s\n", filename);
+        libav_close(d);
+        return -1;
+    }
 
-    FILE *fp = popen(command, "r");
-    if (!fp) {
-        perror("popen failed");
+    d->dec = avcodec_alloc_context3(decoder);
+    if (!d->dec ||
+        avcodec_parameters_to_context(d->dec, d->fmt->streams[d->stream]->codecpar) < 0 ||
+        avcodec_open2(d->dec, decoder, NULL) < 0) {
+        fprintf(stderr, "libav: cannot open %s decoder\n", decoder->name);
+        libav_close(d);
         return -1;
     }
 
-    char buffer[64];
-    if (fgets(buffer, sizeof(buffer), fp) == NULL) {
-        fprintf(stderr, "ffprobe returned no output\n");
-        pclose(fp);
+    // Same quality as ffmpeg -q:v 1
+    const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    d->enc = encoder ? avcodec_alloc_context3(encoder) : NULL;
+    if (!d->enc) {
+        fprintf(stderr, "libav: no MJPEG encoder\n");
+        libav_close(d);
+        return -1;
+    }
+    d->enc->width = width;
+    d->enc->height = height;
+    d->enc->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    d->enc->color_range = AVCOL_RANGE_JPEG;
+    d->enc->time_base = (AVRational){1, 25};
+    d->enc->flags |= AV_CODEC_FLAG_QSCALE;
+    d->enc->global_quality = FF_QP2LAMBDA * 1;
+    if (avcodec_open2(d->enc, encoder, NULL) < 0) {
+        fprintf(stderr, "libav: cannot open MJPEG encoder\n");
+        libav_close(d);
         return -1;
     }
-    pclose(fp);
 
-    if (sscanf(buffer, "%dx%d", width, height) != 2) {
-        fprintf(stderr, "Could not parse dimensions: %s\n", buffer);
+    d->frame = av_frame_alloc();
+    d->yuv = av_frame_alloc();
+    d->pkt = av_packet_alloc();
+    if (!d->frame || !d->yuv || !d->pkt) {
+        libav_close(d);
+        return -1;
+    }
+    d->yuv->format = AV_PIX_FMT_YUVJ420P;
+    d->yuv->width = width;
+    d->yuv->height = height;
+    if (av_frame_get_buffer(d->yuv, 0) < 0) {
+        libav_close(d);
         return -1;
     }
 
     return 0;
 }
 
-/// get_jpeg_dim
+// Decodes the first frame at or after `seconds` into d->frame
+static int libav_decode_at(struct libav_decoder *d, double seconds) {
+    AVStream *st = d->fmt->streams[d->stream];
+    int64_t target = (int64_t)floor(seconds / av_q2d(st->time_base));
 
-bool get_jpeg_dim(BYTE_ARRAY data, size_t data_size, int *width, int *height) {
-	*width = *height = -1;
-	size_t off = 0;
+    if (st->start_time != AV_NOPTS_VALUE) {
+        target += st->start_time;
+    }
+    if (av_seek_frame(d->fmt, d->stream, target, AVSEEK_FLAG_BACKWARD) < 0) {
+        return -1;
+    }
+    avcodec_flush_buffers(d->dec);
+
+    bool draining = false;
+    while (true) {
+        int ret = avcodec_receive_frame(d->dec, d->frame);
+        if (ret == 0) {
+            int64_t pts = d->frame->best_effort_timestamp;
+            if (pts == AV_NOPTS_VALUE || pts >= target) {
+                return 0;
+            }
+            av_frame_unref(d->frame);
+            continue;
+        }
+        if (ret == AVERROR_EOF) {
+            return -1;
+        }
 
-	while (off < data_size) {
-		while(data[off] == 0xff) {
-			off++;
-		}
+        if (draining) {
+            return -1;
+        }
+        ret = av_read_frame(d->fmt, d->pkt);
+        if (ret < 0) {
+            // End of file: flush the decoder for any buffered frames
+            avcodec_send_packet(d->dec, NULL);
+            draining = true;
+            continue;
+        }
+        if (d->pkt->stream_index == d->stream) {
+            avcodec_send_packet(d->dec, d->pkt);
+        }
+        av_packet_unref(d->pkt);
+    }
+}
 
-		int mrkr = data[off];  off++;
+// Returns a malloc'ed JPEG of the cropped frame at `seconds`
+static unsigned char *libav_grab_frame(struct libav_decoder *d, double seconds,
+                                       bool keyframe, size_t *len) {
+    // A snapped time is a keyframe, so every other frame can be discarded
+    d->dec->skip_frame = keyframe ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
 
-		if (mrkr == 0xd8) continue;    // SOI
-		if (mrkr == 0xd9) break;       // EOI
-		if (0xd0 <= mrkr && mrkr <= 0xd7) continue;
-		if (mrkr == 0x01) continue;    // TEM
+    if (libav_decode_at(d, seconds) != 0) {
+        fprintf(stderr, "libav: no frame at %.0f s\n", seconds);
+        return NULL;
+    }
 
-		const int len = (data[off]<<8) | data[off+1];  off += 2;
+    AVFrame *frame = d->frame;
+    frame->crop_top = top_crop;
+    frame->crop_bottom = bottom_crop;
+    if (av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED) < 0) {
+        av_frame_unref(frame);
+        return NULL;
+    }
 
-		if (mrkr == 0xc0) {
-			*height = (data[off+1]<<8) | data[off+2];
-			*width = (data[off+3]<<8) | data[off+4];
-			return true;
-		}
-		off += len - 2;
-	}
-	return false;
+    d->sws = sws_getCachedContext(d->sws, frame->width, frame->height, frame->format,
+                                  d->yuv->width, d->yuv->height, AV_PIX_FMT_YUVJ420P,
+                                  SWS_BICUBIC, NULL, NULL, NULL);
+    if (!d->sws || av_frame_make_writable(d->yuv) < 0) {
+        av_frame_unref(frame);
+        return NULL;
+    }
+    sws_scale(d->sws, (const uint8_t *const *)frame->data, frame->linesize,
+              0, frame->height, d->yuv->data, d->yuv->linesize);
+    av_frame_unref(frame);
+
+    d->yuv->quality = d->enc->global_quality;
+    d->yuv->pts = d->next_pts++;
+
+    unsigned char *jpeg = NULL;
+    if (avcodec_send_frame(d->enc, d->yuv) == 0 &&
+        avcodec_receive_packet(d->enc, d->pkt) == 0) {
+        jpeg = malloc(d->pkt->size);
+        if (jpeg) {
+            memcpy(jpeg, d->pkt->data, d->pkt->size);
+            *len = d->pkt->size;
+        }
+        av_packet_unref(d->pkt);
+    }
+    return jpeg;
 }
 
-/// read_file
+/// extract_frames_libav
 
-unsigned char* read_file(const char* filename, size_t* filesize) {
-	FILE* f = fopen(filename, "rb");
-	if (!f) return NULL;
+int extract_frames_libav(struct page_layout *layout, const struct video_info *video) {
+    struct libav_decoder decoder;
+    bool opened = false;
 
-	fseek(f, 0, SEEK_END);
-	*filesize = ftell(f);
-	rewind(f);
+    if (video->rotation != 0) {
+        fprintf(stderr, "libav backend does not rotate frames, use -b ffmpeg\n");
+        return -1;
+    }
 
-	unsigned char* buffer = malloc(*filesize);
-	if (!buffer) {
-		fclose(f);
-		return NULL;
-	}
+    int result = 0;
+    for (int i = 0; i < timestamp_count && result == 0; i++) {
+        if (frame_ready(i)) {
+            result = place_ready_frame(layout, i);
+            continue;
+        }
 
-	if (fread(buffer, 1, *filesize, f) != *filesize) {
-		free(buffer);
-		fclose(f);
-		return NULL;
-	}
+        // The container is only opened once a frame actually needs decoding
+        if (!opened) {
+            if (libav_open(&decoder, videofile, video->width,
+                           video->height - top_crop - bottom_crop) != 0) {
+                return -1;
+            }
+            opened = true;
+        }
 
-	fclose(f);
-	return buffer;
+        size_t len = 0;
+        unsigned char *jpeg = libav_grab_frame(&decoder, frame_times[i],
+                                               frame_is_key[i], &len);
+        if (!jpeg) {
+            result = -1;
+            break;
+        }
+        frame_cache_store(frame_times[i], jpeg, len);
+        result = place_frame(layout, jpeg, len);
+    }
+
+    if (opened) {
+        libav_close(&decoder);
+    }
+    return result;
 }
 
-/// take_screenshot
+#endif // HAVE_LIBAV
 
-void take_screenshot(int seconds) {
-    char command[512];
-    int video_width, video_height;
+/// Session
 
-    int get_dims = get_video_dimensions(videofile, &video_width, &video_height);
-    if (get_dims != 0) {
-        printf("get_video_dimensions() failed: %d\n", get_dims);
-        return;
-    }
+// In interactive mode the document survives between 'r' commands. As long as
+// the video, crop and backend are unchanged its image objects are reused, so
+// a margin change only lays the pages out again and a timestamp change only
+// extracts the new frames.
+static struct pdf_doc *session_pdf = NULL;
+static uint64_t session_key;
+static int session_count = 0;
+static double session_times[MAX_TIMESTAMPS];
+static struct pdf_object *session_images[MAX_TIMESTAMPS];
 
-    snprintf(command, sizeof(command),
-             "ffmpeg -y -loglevel error -ss %d -i %s -frames:v 1 -q:v 1 -vf \"crop=%d:%d:%d:%d\" %s",
-             seconds,
-             videofile,
-             video_width,                            // width
-             video_height - top_crop - bottom_crop,  // height after cropping
-             0,                                      // x offset
-             top_crop,                               // y offset
-             imgfile);
+/// session_begin
 
-    int return_code = system(command);
+// Returns the document to lay the frames out in, with frame_images[] filled
+// for every timestamp whose image is still embedded
+struct pdf_doc *session_begin(void) {
+    memset(frame_images, 0, sizeof(frame_images));
 
-    if (return_code != 0) {
-        printf("Command execution failed or returned "
-               "non-zero: %d", return_code);
+    uint64_t key = frame_settings_hash();
+    if (session_pdf && (key == 0 || key != session_key)) {
+        session_close();
     }
-}
-
-/// parse_timestamp
 
-int parse_timestamp(const char *str) {
-    int minutes, seconds;
-    if (sscanf(str, "%d:%d", &minutes, &seconds) != 2) {
-        fprintf(stderr, "Ogiltigt tidsformat: %s\n", str);
-        exit(EXIT_FAILURE);
+    if (!session_pdf) {
+        struct pdf_info info = {
+            .creator = "My software",
+            .producer = "My software",
+            .title = "My document",
+            .author = "My name",
+            .subject = "My subject",
+            .date = "Today"
+        };
+
+        struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, &info);
+        if (!pdf) {
+            fprintf(stderr, "Failed to create PDF document\n");
+            return NULL;
+        }
+        pdf_set_font(pdf, typeface);
+        pdf_set_compression(pdf, compress_level, jobs);
+        pdf_set_object_streams(pdf, object_streams);
+        if (keep_session) {
+            session_pdf = pdf;
+            session_key = key;
+        }
+        return pdf;
     }
-    return minutes * 60 + seconds;
-}
-
-/// set_output_path
 
-void set_output_path(const char *videopath, const char *outfilename) {
-    const char *last_sep = strrchr(videopath, '/');
-#ifdef _WIN32
-    if (!last_sep) {
-        last_sep = strrchr(videopath, '\\');  // Windows-separator
-    }
-#endif
+    pdf_clear_pages(session_pdf);
 
-    if (!last_sep) {
-        // Ingen separator – använd nuvarande arbetskatalog
-        if (!getcwd(outputfile, MAX_PATH_LEN)) {
-            perror("getcwd failed");
-            exit(EXIT_FAILURE);
+    // Hand each timestamp an image of the same time from the previous run
+    for (int i = 0; i < timestamp_count; i++) {
+        for (int j = 0; j < session_count; j++) {
+            if (session_images[j] && session_times[j] == frame_times[i]) {
+                frame_images[i] = session_images[j];
+                session_images[j] = NULL;
+                break;
+            }
         }
+    }
 
-        size_t len = strlen(outputfile);
-        if (len + 1 >= MAX_PATH_LEN) {
-            fprintf(stderr, "Sökvägen är för lång\n");
-            exit(EXIT_FAILURE);
+    // Frames no one wants any more
+    for (int j = 0; j < session_count; j++) {
+        if (session_images[j]) {
+            pdf_del_image(session_pdf, session_images[j]);
         }
+    }
+    session_count = 0;
+    return session_pdf;
+}
 
-        outputfile[len] = '/';
-        outputfile[len + 1] = '\0';
+/// session_end
 
-        strncat(outputfile, outfilename, MAX_PATH_LEN - strlen(outputfile) - 1);
+// Remembers the images of a successful interactive run. Anything else ends
+// the session.
+void session_end(struct pdf_doc *pdf, bool keep) {
+    if (pdf != session_pdf) {
+        pdf_destroy(pdf);
         return;
     }
-
-    // Hämta katalogdelen av sökvägen
-    size_t dirlen = last_sep - videopath + 1;
-    if (dirlen >= MAX_PATH_LEN) {
-        fprintf(stderr, "Sökvägen är för lång\n");
-        exit(EXIT_FAILURE);
+    if (!keep) {
+        session_close();
+        return;
     }
+    memcpy(session_times, frame_times, timestamp_count * sizeof(double));
+    memcpy(session_images, frame_images, timestamp_count * sizeof(frame_images[0]));
+    session_count = timestamp_count;
+}
 
-    strncpy(outputfile, videopath, dirlen);
-    outputfile[dirlen] = '\0';
+/// session_close
 
-    strncat(outputfile, outfilename, MAX_PATH_LEN - dirlen - 1);
+void session_close(void) {
+    pdf_destroy(session_pdf);
+    session_pdf = NULL;
+    session_count = 0;
 }
 
 /// create_pdf
 
 int create_pdf() {
-    struct pdf_info info = {
-        .creator = "My software",
-        .producer = "My software",
-        .title = "My document",
-        .author = "My name",
-        .subject = "My subject",
-        .date = "Today"
-    };
-
-    struct pdf_doc *pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, &info);
-    pdf_set_font(pdf, typeface);
-
-    int display_width = PDF_A4_WIDTH - 2 * margins;
-    int this_y_pos = start_y_pos - top_margin;
+    // All frames share the probed video size, so the layout is known up front
+    const struct video_info *video = get_video_info(videofile);
+    if (!video) {
+        return 1;
+    }
+    if (resolve_frame_times() != 0) {
+        return 1; // No keyframe index to snap to
+    }
 
-    int pagenr = 0;
-    char page_str[20];
+    struct pdf_doc *pdf = session_begin();
+    if (!pdf) {
+        return 1;
+    }
 
-    for (int i = 0; i < timestamp_count; i++) {
-        take_screenshot(timestamps[i]);
+    int video_width;
+    int video_height;
+    video_display_size(video, &video_width, &video_height);
+    int img_height = video_height - top_crop - bottom_crop;
 
-        size_t filesize = 0;
-        unsigned char* jpeg_data = read_file(imgfile, &filesize);
-        if (!jpeg_data) {
-            fprintf(stderr, "Failed to read file.\n");
+    struct page_layout layout = {
+        .pdf = pdf,
+        .display_width = PDF_A4_WIDTH - 2 * margins,
+        .this_y_pos = start_y_pos - top_margin,
+    };
+    float scale = (float)layout.display_width / video_width;
+    layout.scaled_height = img_height * scale;
+
+    // An interactive session keeps its images for the next run. Otherwise the
+    // document is written out page by page as it is built.
+    if (pdf != session_pdf) {
+        if (pdf_save_begin(pdf, outputfile) < 0) {
+            fprintf(stderr, "%s\n", pdf_get_err(pdf, NULL));
+            pdf_destroy(pdf);
             return 1;
         }
+        layout.streaming = true;
+    }
+
+    frame_cache_fetch();
 
-        int img_width;
-        int img_height;
-        get_jpeg_dim(jpeg_data, filesize, &img_width, &img_height);
-        free(jpeg_data);
+    int result = 0;
+#ifdef HAVE_LIBAV
+    if (use_libav) {
+        result = extract_frames_libav(&layout, video);
+    }
+    else
+#endif
+    if (single_pass) {
+        result = extract_frames_pipe(&layout, video_width, video_height, jobs);
+    }
+    else if (queue_depth > 0) {
+        result = extract_frames_pipelined(&layout, jobs, queue_depth);
+    }
+    else if (jobs > 1) {
+        result = extract_frames_parallel(&layout, jobs);
+    }
+    else {
+        for (int i = 0; i < timestamp_count && result == 0; i++) {
+            if (frame_ready(i)) {
+                result = place_ready_frame(&layout, i);
+                continue;
+            }
 
-        float scale = (float)display_width / img_width;
-        int scaled_height = img_height * scale;
+            char path[MAX_PATH_LEN + 32];
+            frame_imgfile(path, sizeof(path), i);
+            take_screenshot(frame_times[i], frame_is_key[i], path);
 
-        if (i == 0 || this_y_pos - scaled_height < 0) {
-            pdf_append_page(pdf);
-            this_y_pos = start_y_pos - top_margin;
-            pagenr++;
-        }
-        else {
-            this_y_pos -= scaled_height;
+            size_t filesize = 0;
+            unsigned char *jpeg_data = read_file(path, &filesize);
+            remove(path);
+            if (!jpeg_data) {
+                fprintf(stderr, "Failed to read file.\n");
+                result = -1;
+                break;
+            }
+            frame_cache_store(frame_times[i], jpeg_data, filesize);
+            result = place_frame(&layout, jpeg_data, filesize);
         }
+    }
 
-        pdf_add_image_file(pdf, NULL,
-                           margins,
-                           this_y_pos + margins + bottom_crop,
-                           display_width,
-                           -1,
-                           imgfile);
-        remove(imgfile);
+    frame_cache_release();
+    frame_cache_trim();
 
-        sprintf(page_str, "%d", pagenr);
-        float text_width;
-        pdf_get_font_text_width(pdf, typeface, page_str, font_size, &text_width);
-        int x = (PDF_A4_WIDTH - text_width) / 2;
-        pdf_add_text(pdf, NULL, page_str, font_size, x, 15, PDF_BLACK);
+    if (result != 0) {
+        session_end(pdf, false);
+        if (layout.streaming) {
+            remove(outputfile);
+        }
+        return 1;
     }
 
-    pdf_save(pdf, outputfile);
-    pdf_destroy(pdf);
-    return 0;
+    if (layout.streaming) {
+        result = pdf_save_end(pdf);
+    }
+    else {
+        result = pdf_save(pdf, outputfile);
+    }
+    if (result < 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", outputfile, pdf_get_err(pdf, NULL));
+    }
+    session_end(pdf, result >= 0);
+    return result < 0 ? 1 : 0;
 }
 
 /// format_timestamp()
@@ -374,6 +2410,7 @@ void prompt_help(void) {
     printf("  j <crop bottom> (optional)\n");
     printf("  k <crop top> (optional)\n");
     printf("  u <top margin> (optional)\n");
+    printf("  p toggle single-pass extraction\n");
     printf("  s show settings\n");
     printf("  c clear settings\n");
     printf("  r run\n");
@@ -388,6 +2425,7 @@ void prompt_for_input(void) {
     char input[1024];
     printf("Welcome to VIP!\n");
     prompt_help();
+    keep_session = true;
 
     char *url = NULL;
     url = malloc(MAX_PATH_LEN);
@@ -458,6 +2496,11 @@ void prompt_for_input(void) {
             printf("Bottom crop set to: %d\n", bottom_crop);
             break;
 
+        case 'p':
+            single_pass = !single_pass;
+            printf("Single-pass extraction: %s\n", single_pass ? "on" : "off");
+            break;
+
         case 't': {
             if (strlen(argument) == 0) {
                 printf("No time stamps given.\n");
@@ -511,6 +2554,7 @@ void prompt_for_input(void) {
             printf("  Top margin: %d\n", top_margin);
             printf("  Bottom crop: %d\n", bottom_crop);
             printf("  Top crop: %d\n", top_crop);
+            printf("  Single-pass: %s\n", single_pass ? "on" : "off");
             printf("  Time stamps: ");
             if (timestamp_count > 0) {
                 for (int i = 0; i < timestamp_count; i++) {
@@ -543,13 +2587,15 @@ void prompt_for_input(void) {
 
         case 'q':
             printf("Quitting.\n");
+            session_close();
             return;
 
         default:
-            printf("Type i, o, m, u, t, r, s, c, h or q.\n");
+            printf("Type i, o, m, u, p, t, r, s, c, h or q.\n");
             break;
         }
     }
+    session_close();
 }
 
 /// file_exists()
@@ -566,7 +2612,7 @@ bool file_exists(const char *filename) {
 /// help()
 
 void help(void) {
-    printf("Options:\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n\n",
+    printf("Options:\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n  %s\n\n",
            "-d, --download=<url>",
            "-i, --input=<inputfile>",
            "-o, --output=<outputfile>",
@@ -575,6 +2621,14 @@ void help(void) {
            "-j, --bottom_crop=<bottom crop>",
            "-k, --top_crop=<top crop>",
            "-t, --timestamps=<timestamps>",
+           "-s, --single-pass (extract all frames with one ffmpeg run)",
+           "-J, --jobs=<number of parallel ffmpeg runs>",
+           "-b, --backend=<ffmpeg|libav>",
+           "-S, --snap=keyframe[:<tolerance in seconds>]",
+           "-C, --cache-size=<frame cache size in MB, 0 disables>",
+           "-Q, --queue-depth=<frames extracted ahead, 0 disables>",
+           "-z, --compress=<compression level 0-9, default 0 = off>",
+           "-O, --object-streams (smaller PDF 1.5 file structure)",
            "-h, --help");
 
     /* printf("Options:\n"); */
@@ -600,19 +2654,9 @@ int main(int argc, char *argv[]) {
     setlocale(LC_ALL, "");
 #endif
 
-#ifdef _WIN32
-    const char *tempdir = getenv("TEMP");
-    if (!tempdir) {
-        tempdir = "."; // Om TEMP inte är satt, använd aktuell katalog
-    }
-    snprintf(imgfile, sizeof(imgfile), "%s\\vip-screenshot.jpg", tempdir);
-#else
-    const char *tempdir = getenv("TMPDIR");
-    if (!tempdir) {
-        tempdir = "/tmp";
+    if (make_workdir() != 0) {
+        return EXIT_FAILURE;
     }
-    snprintf(imgfile, sizeof(imgfile), "%s/vip-screenshot.jpg", tempdir);
-#endif
 
     int opt;
     int option_index = 0;
@@ -626,7 +2670,7 @@ int main(int argc, char *argv[]) {
     videofile = malloc(MAX_PATH_LEN);
     videofile[0] = '\0';
 
-    while ((opt = getopt_long(argc, argv, "d:i:o:m:u:k:j:t:h", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:i:o:m:u:k:j:t:sJ:b:S:C:Q:z:Oh", long_options, &option_index)) != -1) {
         switch (opt) {
 
         case 'd':
@@ -663,6 +2707,77 @@ int main(int argc, char *argv[]) {
             bottom_crop = atoi(optarg);
             break;
 
+        case 's':
+            single_pass = true;
+            break;
+
+        case 'b':
+            if (strcmp(optarg, "libav") == 0) {
+#ifdef HAVE_LIBAV
+                use_libav = true;
+#else
+                fprintf(stderr, "Built without libav support (compile with -DHAVE_LIBAV)\n");
+                return EXIT_FAILURE;
+#endif
+            }
+            else if (strcmp(optarg, "ffmpeg") == 0) {
+                use_libav = false;
+            }
+            else {
+                fprintf(stderr, "Unknown backend: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'S':
+            // keyframe[:tolerance in seconds]
+            if (strncmp(optarg, "keyframe", 8) != 0 ||
+                (optarg[8] != '\0' && optarg[8] != ':')) {
+                fprintf(stderr, "Unknown snap mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            snap_keyframes = true;
+            if (optarg[8] == ':') {
+                snap_tolerance = parse_decimal(optarg + 9);
+            }
+            break;
+
+        case 'C':
+            cache_size_mb = atoi(optarg);
+            if (cache_size_mb < 0) {
+                fprintf(stderr, "Cache size must be 0 or more MB\n");
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'Q':
+            queue_depth = atoi(optarg);
+            if (queue_depth < 0 || queue_depth > MAX_QUEUE_DEPTH) {
+                fprintf(stderr, "Queue depth must be 0-%d\n", MAX_QUEUE_DEPTH);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'z':
+            compress_level = atoi(optarg);
+            if (compress_level < PDF_COMPRESS_NONE || compress_level > PDF_COMPRESS_BEST) {
+                fprintf(stderr, "Compression level must be %d-%d\n", PDF_COMPRESS_NONE, PDF_COMPRESS_BEST);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'O':
+            object_streams = true;
+            break;
+
+        case 'J':
+            jobs = atoi(optarg);
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                fprintf(stderr, "Number of jobs must be 1-%d\n", MAX_JOBS);
+                return EXIT_FAILURE;
+            }
+            break;
+
         case 't':
             if (timestamp_count >= MAX_TIMESTAMPS) {
                 fprintf(stderr, "För många tidsstämplar (max %d)\n", MAX_TIMESTAMPS);